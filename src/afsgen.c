@@ -0,0 +1,293 @@
+#include <unistd.h>
+#include "afsgen.h"
+
+/**** A generator of synthetic AFS images, for testing and benchmarking the defragmenter ****/
+
+unsigned long long genState;
+
+/**
+ * xorshift64* pseudo random generator, so images only depend on the seed
+ */
+unsigned long long nextRandom() {
+    genState ^= genState >> 12;
+    genState ^= genState << 25;
+    genState ^= genState >> 27;
+    return genState * 2685821657736338717ULL;
+}
+
+/**
+ * Uniform random integer in [low, high]
+ */
+long randomBetween(long low, long high) {
+    return low + (long) (nextRandom() % (unsigned long long) (high - low + 1));
+}
+
+void defaultParams(afsParams *params) {
+    params->blockSize = DEFAULT_BLOCK_SIZE;
+    params->inodeCount = 256;
+    params->fileCount = 128;
+    params->distribution = SIZE_MIXED;
+    params->fragmentation = 1.0;
+    params->indirection = 1;
+    params->freeBlocks = 256;
+    params->swapBlocks = 64;
+    params->seed = 1;
+    params->gapBlocks = 0;
+}
+
+/**
+ * Largest number of data blocks a file may hold using pointers up to given level
+ */
+long levelCapacity(int level, long fanout) {
+    long capacity = N_DBLOCKS;
+    if (level >= 1) {
+        capacity += N_IBLOCKS * fanout;
+    }
+    if (level >= 2) {
+        capacity += fanout * fanout;
+    }
+    if (level >= 3) {
+        capacity += fanout * fanout * fanout;
+    }
+    return capacity;
+}
+
+/**
+ * Number of indirect blocks needed by a file of n data blocks
+ */
+long indirectCount(long n, long fanout) {
+    long count = 0, chunk;
+    int i;
+    n -= n < N_DBLOCKS ? n : N_DBLOCKS;
+    for (i = 0; i < N_IBLOCKS && n > 0; i++) {
+        count++;
+        n -= n < fanout ? n : fanout;
+    }
+    if (n > 0) {
+        chunk = n < fanout * fanout ? n : fanout * fanout;
+        count += 1 + (chunk + fanout - 1) / fanout;
+        n -= chunk;
+    }
+    if (n > 0) {
+        count += 1 + (n + fanout * fanout - 1) / (fanout * fanout) + (n + fanout - 1) / fanout;
+    }
+    return count;
+}
+
+/**
+ * Pick the size in bytes of the index-th file
+ * The first file always reaches the deepest indirection level asked for, so every level gets exercised
+ */
+long pickFileSize(afsParams *params, int index, long fanout) {
+    long cap = levelCapacity(params->indirection, fanout);
+    long floor = params->indirection > 0 ? levelCapacity(params->indirection - 1, fanout) : 1;
+    long blocks;
+
+    if (params->indirection == 3) { // a full I3 tree is far too large, just step into it
+        cap = floor + fanout * fanout;
+    }
+    if (index == 0) {
+        blocks = randomBetween(floor + 1 < cap ? floor + 1 : cap, cap);
+    } else if (params->distribution == SIZE_SMALL) {
+        blocks = randomBetween(1, N_DBLOCKS < cap ? N_DBLOCKS : cap);
+    } else if (params->distribution == SIZE_LARGE) {
+        blocks = randomBetween(cap / 2 > 0 ? cap / 2 : 1, cap);
+    } else { // log-uniform: pick a bit length first
+        int bits = 0;
+        while ((1L << bits) < cap) {
+            bits++;
+        }
+        blocks = randomBetween(1L << randomBetween(0, bits - 1 > 0 ? bits - 1 : 0), 1L << bits);
+        blocks = blocks < cap ? blocks : cap;
+    }
+    return blocks * params->blockSize - randomBetween(0, params->blockSize - 1);
+}
+
+// state of the file being generated
+FILE *genOut;
+size_t genBlockSize;
+off_t genDataInitial;
+int *genOrder;    // physical location of the k-th allocated block
+long genCursor;   // number of blocks allocated so far
+char *genBuffer;
+
+int allocateBlock() {
+    return genOrder[genCursor++];
+}
+
+void writeGenBlock(int blk, const void *buffer) {
+    pwrite(fileno(genOut), buffer, genBlockSize, genDataInitial + (off_t) blk * genBlockSize);
+}
+
+/**
+ * Write a data block of random content and return its location
+ */
+int generateDataBlock() {
+    size_t i;
+    int blk = allocateBlock();
+    for (i = 0; i + sizeof(unsigned long long) <= genBlockSize; i += sizeof(unsigned long long)) {
+        *(unsigned long long *) (genBuffer + i) = nextRandom();
+    }
+    writeGenBlock(blk, genBuffer);
+    return blk;
+}
+
+/**
+ * Build an indirect tree of given level (1 for I1), block allocated before its children,
+ * the way a defragmented image lays it out when fragmentation is 0
+ */
+int generateIndirectBlock(int level, long *remain, long fanout) {
+    long i;
+    int blk = allocateBlock();
+    int *pointers = calloc(fanout, sizeof(int));
+    for (i = 0; i < fanout && *remain > 0; i++) {
+        if (level == 1) {
+            pointers[i] = generateDataBlock();
+            (*remain)--;
+        } else {
+            pointers[i] = generateIndirectBlock(level - 1, remain, fanout);
+        }
+    }
+    writeGenBlock(blk, pointers);
+    free(pointers);
+    return blk;
+}
+
+/**
+ * This function write a complete synthetic image into out according to params
+ * Layout: boot block, super block, gap, inode region, data region (files, then free blocks), swap region
+ * The gap is never written, so on most filesystems it takes no space
+ * Blocks are first allocated in order, then a share of them is shuffled to produce fragmentation
+ * @return Size of the image in bytes
+ */
+off_t generateImage(FILE *out, afsParams *params) {
+    long i, j;
+    long fanout = params->blockSize / sizeof(int);
+    int inodeSize = 100;
+    genState = params->seed * 0x9E3779B97F4A7C15ULL + 1;
+    genOut = out;
+    genBlockSize = params->blockSize;
+
+    // sizes first, the data region is exactly as large as needed
+    long *sizes = malloc(sizeof(long) * params->fileCount);
+    long dataBlocks = params->freeBlocks;
+    for (i = 0; i < params->fileCount; i++) {
+        sizes[i] = pickFileSize(params, (int) i, fanout);
+        long n = (sizes[i] + params->blockSize - 1) / params->blockSize;
+        dataBlocks += n + indirectCount(n, fanout);
+    }
+
+    superblock *superBlock = calloc(1, DEFAULT_BLOCK_SIZE);
+    superBlock->size = params->blockSize;
+    superBlock->inode_offset = params->gapBlocks;
+    int inodeBlocks = (params->inodeCount * inodeSize + params->blockSize - 1) / params->blockSize;
+    superBlock->data_offset = superBlock->inode_offset + inodeBlocks;
+    superBlock->swap_offset = superBlock->data_offset + (int) dataBlocks;
+    genDataInitial = 1024 + (off_t) superBlock->data_offset * params->blockSize;
+    off_t imageSize = 1024 + ((off_t) superBlock->swap_offset + params->swapBlocks) * params->blockSize;
+
+    // shuffle a share of the allocation order
+    genOrder = malloc(sizeof(int) * dataBlocks);
+    for (i = 0; i < dataBlocks; i++) {
+        genOrder[i] = (int) i;
+    }
+    long shuffled = (long) (params->fragmentation * dataBlocks);
+    long *picked = malloc(sizeof(long) * (dataBlocks + 1));
+    for (i = 0; i < dataBlocks; i++) {
+        picked[i] = i;
+    }
+    for (i = 0; i < shuffled; i++) { // choose which positions take part
+        j = randomBetween(i, dataBlocks - 1);
+        long t = picked[i];
+        picked[i] = picked[j];
+        picked[j] = t;
+    }
+    for (i = shuffled - 1; i > 0; i--) { // then permute their blocks
+        j = randomBetween(0, i);
+        int t = genOrder[picked[i]];
+        genOrder[picked[i]] = genOrder[picked[j]];
+        genOrder[picked[j]] = t;
+    }
+    free(picked);
+
+    // spread live files over the inode table, the others form the free inode list
+    char *inodeRegion = calloc(inodeBlocks, params->blockSize);
+    char *live = calloc(params->inodeCount, 1);
+    for (i = 0; i < params->fileCount; i++) {
+        do {
+            j = randomBetween(0, params->inodeCount - 1);
+        } while (live[j]);
+        live[j] = 1;
+    }
+
+    genBuffer = malloc(params->blockSize);
+    genCursor = 0;
+    long file = 0;
+    for (i = 0; i < params->inodeCount; i++) {
+        if (!live[i]) {
+            continue;
+        }
+        inode *node = (inode *) (inodeRegion + i * inodeSize);
+        long remain = (sizes[file] + params->blockSize - 1) / params->blockSize;
+        node->protect = 0644;
+        node->nlink = 1;
+        node->size = (int) sizes[file++];
+        node->uid = (int) randomBetween(0, 3);
+        node->gid = (int) randomBetween(0, 3);
+        node->ctime = (int) randomBetween(1000000000, 1500000000);
+        node->mtime = (int) randomBetween(node->ctime, 1600000000);
+        node->atime = (int) randomBetween(node->mtime, 1700000000);
+        for (j = 0; j < N_DBLOCKS && remain > 0; j++, remain--) {
+            node->dblocks[j] = generateDataBlock();
+        }
+        for (j = 0; j < N_IBLOCKS && remain > 0; j++) {
+            node->iblocks[j] = generateIndirectBlock(1, &remain, fanout);
+        }
+        if (remain > 0) {
+            node->i2block = generateIndirectBlock(2, &remain, fanout);
+        }
+        if (remain > 0) {
+            node->i3block = generateIndirectBlock(3, &remain, fanout);
+        }
+    }
+
+    // free inode list in index order
+    int last = -1;
+    superBlock->free_inode = -1;
+    for (i = params->inodeCount - 1; i >= 0; i--) {
+        if (!live[i]) {
+            ((inode *) (inodeRegion + i * inodeSize))->next_inode = last;
+            last = (int) i;
+        }
+    }
+    superBlock->free_inode = last;
+
+    // free data list follows allocation order, so it is as fragmented as files are
+    superBlock->free_iblock = genCursor < dataBlocks ? genOrder[genCursor] : -1;
+    memset(genBuffer, 0xEE, params->blockSize);
+    while (genCursor < dataBlocks) {
+        int blk = allocateBlock();
+        *(int *) genBuffer = genCursor < dataBlocks ? genOrder[genCursor] : -1;
+        writeGenBlock(blk, genBuffer);
+    }
+
+    // boot block, super block, inode region and swap region
+    memset(genBuffer, 'B', params->blockSize);
+    pwrite(fileno(out), genBuffer, DEFAULT_BLOCK_SIZE, 0);
+    pwrite(fileno(out), superBlock, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+    pwrite(fileno(out), inodeRegion, (size_t) inodeBlocks * params->blockSize,
+           1024 + (off_t) superBlock->inode_offset * params->blockSize);
+    for (i = 0; i < params->swapBlocks; i++) {
+        memset(genBuffer, (int) (i & 0xFF), params->blockSize);
+        pwrite(fileno(out), genBuffer, params->blockSize,
+               1024 + ((off_t) superBlock->swap_offset + i) * params->blockSize);
+    }
+
+    free(genBuffer);
+    free(live);
+    free(inodeRegion);
+    free(genOrder);
+    free(superBlock);
+    free(sizes);
+    return imageSize;
+}
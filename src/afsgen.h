@@ -0,0 +1,29 @@
+#ifndef P5_AFSGEN_H
+#define P5_AFSGEN_H
+
+#include <stdio.h>
+#include "defrag.h"
+
+// file size distributions of generated images
+#define SIZE_SMALL 0 /* a few blocks per file, direct blocks only in practice */
+#define SIZE_MIXED 1 /* log-uniform, from a single byte up to the cap of chosen indirection level */
+#define SIZE_LARGE 2 /* every file close to the cap of chosen indirection level */
+
+typedef struct {
+    int blockSize;       /* size of blocks in bytes */
+    int inodeCount;      /* number of inodes in inode region */
+    int fileCount;       /* number of live files, no more than inodeCount */
+    int distribution;    /* one of SIZE_* */
+    double fragmentation; /* share of data blocks shuffled out of order, 0 is a defragmented image */
+    int indirection;     /* deepest pointer level files may use, 0 direct only, up to 3 for I3 */
+    int freeBlocks;      /* free data blocks besides files */
+    int swapBlocks;      /* blocks in swap region */
+    unsigned seed;       /* images are reproducible for a given seed */
+    int gapBlocks;       /* unused blocks ahead of inode region, left as a hole, to get huge sparse images */
+} afsParams;
+
+void defaultParams(afsParams *params);
+
+off_t generateImage(FILE *out, afsParams *params);
+
+#endif //P5_AFSGEN_H
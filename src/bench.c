@@ -0,0 +1,185 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "afsgen.h"
+#include "blocks.h"
+
+/**** Benchmark harness: run defragmenter() over a matrix of synthetic images and engines ****/
+
+typedef struct {
+    const char *name;
+    int engine;
+    int threads;
+} benchEngine;
+
+benchEngine engines[] = {
+    {"stdio",  ENGINE_STDIO, 1},
+    {"mmap",   ENGINE_MMAP,  1},
+    {"uring",  ENGINE_URING, 1},
+    {"stdio-j4", ENGINE_STDIO, 4},
+};
+
+// blockSize, inodeCount, fileCount, distribution, fragmentation, indirection, freeBlocks, swapBlocks, seed, gapBlocks
+afsParams cases[] = {
+    {512,  8192, 4096, SIZE_SMALL, 1.0, 0, 4096, 64, 1},
+    {512,  2048, 1024, SIZE_MIXED, 0.1, 1, 4096, 64, 2},
+    {512,  2048, 1024, SIZE_MIXED, 1.0, 1, 4096, 64, 3},
+    {512,  256,  64,   SIZE_LARGE, 1.0, 2, 4096, 64, 4},
+    {512,  64,   8,    SIZE_MIXED, 1.0, 3, 4096, 64, 5},
+    {1024, 512,  128,  SIZE_LARGE, 1.0, 1, 4096, 64, 6},
+    {2048, 1024, 96,   SIZE_MIXED, 0.5, 1, 4096, 64, 7},
+    {4096, 1024, 48,   SIZE_MIXED, 1.0, 1, 4096, 64, 8},
+    {4096, 256,  64,   SIZE_LARGE, 1.0, 1, 4096, 64, 9},
+};
+
+// blocks of 4 KiB left as a hole ahead of inode region, so offsets go far beyond what 32 bits address
+#define SCALING_GAP (64 << 20)
+
+// same kind of files over data regions doubling in size, run time should double as well, whatever the image size
+afsParams scaling[] = {
+    {4096, 64, 16, SIZE_LARGE, 1.0, 1, 4096, 64, 10, SCALING_GAP},
+    {4096, 64, 32, SIZE_LARGE, 1.0, 1, 4096, 64, 11, SCALING_GAP},
+    {4096, 64, 64, SIZE_LARGE, 1.0, 1, 4096, 64, 12, SCALING_GAP},
+};
+
+const char *distributionName[] = {"small", "mixed", "large"};
+
+// block sizes with a specialised zero test, see selectKernels
+size_t kernelSizes[] = {512, 1024, 2048, 4096};
+
+#define KERNEL_WINDOW (1 << 20) // bytes a zero test sweeps per pass, a staging window of the sparse pass
+#define KERNEL_BYTES  (1 << 30) // bytes a zero test sweeps in all, passes are repeated up to that
+
+volatile int kernelSink; // zero tests feed it, so they are not optimised away
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Defragment image once in a child process, so peak RSS is measured for this run only
+ * @return 0 on success, the child exit status otherwise
+ */
+int runOnce(const char *image, const char *output, benchEngine *engine, double *seconds, long *peakKb) {
+    struct rusage usage;
+    int status;
+    double start = now();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO); // keep the super block dump out of the report
+        FILE *inFile = fopen(image, "r");
+        FILE *outFile = fopen(output, "w+");
+        if (inFile == NULL || outFile == NULL) {
+            _exit(2);
+        }
+        defragOptions options;
+        defaultOptions(&options);
+        options.engine = engine->engine;
+        options.threads = engine->threads;
+        defragContext *ctx = createContext(&options);
+        int result = defragmenter(ctx, inFile, outFile, NULL);
+        destroyContext(ctx);
+        fclose(inFile);
+        fclose(outFile);
+        _exit(result);
+    }
+
+    wait4(pid, &status, 0, &usage);
+    *seconds = now() - start;
+    *peakKb = usage.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Generate the image of one case, then defragment it with every engine and print a line per run
+ * Throughput counts the blocks of the image only, the gap ahead of inode region is a hole nobody reads
+ */
+void benchCase(const char *image, const char *output, afsParams *params) {
+    int j;
+    FILE *imageFile = fopen(image, "w");
+    if (imageFile == NULL) {
+        perror("Cannot create benchmark image.");
+        exit(1);
+    }
+    off_t size = generateImage(imageFile, params);
+    fclose(imageFile);
+    double megabytes = (size - (off_t) params->gapBlocks * params->blockSize) / 1048576.0;
+
+    for (j = 0; j < sizeof(engines) / sizeof(engines[0]); j++) {
+        double seconds;
+        long peakKb;
+        int result = runOnce(image, output, &engines[j], &seconds, &peakKb);
+        printf("%-5d %-6s %-5.2f %-3d %-6d %9.1f %7.1f  %-9s %9.3f %9.1f %10ld%s\n",
+               params->blockSize, distributionName[params->distribution], params->fragmentation,
+               params->indirection, params->fileCount, megabytes, size / 1073741824.0, engines[j].name,
+               seconds, megabytes / seconds, peakKb, result == 0 ? "" : "  FAILED");
+    }
+    remove(image);
+    remove(output);
+}
+
+/**
+ * Seconds a zero test takes to sweep KERNEL_BYTES, window by window, the way the sparse pass calls it,
+ * over zero blocks, which is where a test has to look at every byte
+ */
+double timeKernel(blockKernels *kernels, char *window) {
+    size_t pass, k, n = KERNEL_WINDOW / kernels->blockSize;
+    double start = now();
+    for (pass = 0; pass < KERNEL_BYTES / KERNEL_WINDOW; pass++) {
+        for (k = 0; k < n; k++) {
+            kernelSink += kernels->isZero(window + k * kernels->blockSize, kernels->blockSize);
+        }
+    }
+    return now() - start;
+}
+
+/**
+ * Compare the generic zero test with the ones specialised for every block size, in memory, no image involved
+ */
+void benchKernels() {
+    char *window = allocBlocks(KERNEL_WINDOW / DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+    size_t i;
+
+    memset(window, 0, KERNEL_WINDOW);
+    printf("\nKernels: MB/s of generic and specialised zero tests, %d MB swept in %d KB windows\n",
+           KERNEL_BYTES >> 20, KERNEL_WINDOW >> 10);
+    printf("%-5s %9s %11s %8s\n", "block", "generic", "specialised", "speedup");
+    for (i = 0; i < sizeof(kernelSizes) / sizeof(kernelSizes[0]); i++) {
+        blockKernels generic, specialised;
+        selectKernels(&generic, kernelSizes[i], 1);
+        selectKernels(&specialised, kernelSizes[i], 0);
+        double genericSeconds = timeKernel(&generic, window);
+        double specialisedSeconds = timeKernel(&specialised, window);
+        printf("%-5zu %9.1f %11.1f %7.2fx\n", kernelSizes[i],
+               (KERNEL_BYTES >> 20) / genericSeconds, (KERNEL_BYTES >> 20) / specialisedSeconds,
+               genericSeconds / specialisedSeconds);
+    }
+    free(window);
+}
+
+int main(int argc, char* argv[]) {
+    const char *directory = argc > 1 ? argv[1] : ".";
+    char image[4096], output[4096];
+    int i;
+    snprintf(image, sizeof(image), "%s/bench.img", directory);
+    snprintf(output, sizeof(output), "%s/bench-defrag.img", directory);
+
+    printf("%-5s %-6s %-5s %-3s %-6s %9s %7s  %-9s %9s %9s %10s\n",
+           "block", "dist", "frag", "lvl", "files", "MB", "GB", "engine", "seconds", "MB/s", "peak KB");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        benchCase(image, output, &cases[i]);
+    }
+    printf("\nScaling: data regions of growing size in sparse images of %lld GB\n",
+           (long long) SCALING_GAP * 4096 >> 30);
+    for (i = 0; i < sizeof(scaling) / sizeof(scaling[0]); i++) {
+        benchCase(image, output, &scaling[i]);
+    }
+    benchKernels();
+    return 0;
+}
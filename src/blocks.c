@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blocks.h"
+
+typedef uint64_t blockVector __attribute__((vector_size(16))); // SSE2 on x86-64, NEON on arm64
+#define STEP_BYTES (4 * sizeof(blockVector)) // bytes one unrolled step handles
+
+/**
+ * Generic version, for any block size, the size is only known at run time
+ */
+static int isZeroGeneric(const void *block, size_t blockSize) {
+    const char *p = block;
+    size_t k;
+    for (k = 0; k < blockSize && p[k] == 0; k++);
+    return k == blockSize;
+}
+
+/**
+ * Body of the specialised versions, always inlined into a function of a fixed size,
+ * so the compiler sees a loop of known length and unrolls it
+ * Vectors go through memcpy, blocks of a mapped image or of a patch buffer are not aligned on 16 bytes
+ */
+static inline __attribute__((always_inline))
+int isZeroFixed(const char *block, size_t size) {
+    size_t k;
+    for (k = 0; k < size; k += STEP_BYTES) { // a data block is told apart within its first step
+        blockVector a, b, c, d;
+        memcpy(&a, block + k, sizeof(blockVector));
+        memcpy(&b, block + k + 16, sizeof(blockVector));
+        memcpy(&c, block + k + 32, sizeof(blockVector));
+        memcpy(&d, block + k + 48, sizeof(blockVector));
+        blockVector any = (a | b) | (c | d);
+        if ((any[0] | any[1]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define FIXED_KERNELS(size) \
+    static int isZero##size(const void *block, size_t blockSize) { \
+        return isZeroFixed(block, size); \
+    }
+
+FIXED_KERNELS(512)
+FIXED_KERNELS(1024)
+FIXED_KERNELS(2048)
+FIXED_KERNELS(4096)
+
+/**
+ * Fill kernels for given block size, a specialised zero test when there is one, the generic one otherwise
+ * @param generic Non-zero to take generic kernels whatever the size, e.g. to compare both
+ */
+void selectKernels(blockKernels *kernels, size_t blockSize, int generic) {
+    kernels->blockSize = blockSize;
+    kernels->fanout = blockSize / sizeof(int);
+    kernels->shift = -1;
+    if (blockSize > 0 && (blockSize & (blockSize - 1)) == 0) {
+        for (kernels->shift = 0; ((size_t) 1 << kernels->shift) < blockSize; kernels->shift++);
+    }
+    kernels->specialised = !generic;
+    switch (generic ? 0 : blockSize) {
+        case 512:
+            kernels->isZero = isZero512;
+            break;
+        case 1024:
+            kernels->isZero = isZero1024;
+            break;
+        case 2048:
+            kernels->isZero = isZero2048;
+            break;
+        case 4096:
+            kernels->isZero = isZero4096;
+            break;
+        default:
+            kernels->specialised = 0;
+            kernels->isZero = isZeroGeneric;
+    }
+}
+
+/**
+ * Buffer of count blocks aligned on BLOCK_ALIGN, to be released with free
+ */
+void *allocBlocks(size_t count, size_t blockSize) {
+    void *buffer = NULL;
+    size_t length = count * blockSize > 0 ? count * blockSize : BLOCK_ALIGN;
+    return posix_memalign(&buffer, BLOCK_ALIGN, (length + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN) == 0 ?
+            buffer : NULL;
+}
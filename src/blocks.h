@@ -0,0 +1,24 @@
+#ifndef P5_BLOCKS_H
+#define P5_BLOCKS_H
+
+#include <stddef.h>
+
+#define BLOCK_ALIGN 64 // alignment of block buffers, a cache line, so the vector loops never split a line
+
+// Constants and kernels working on whole blocks of one size, picked once per image by selectKernels
+// Block sizes of 512, 1024, 2048 and 4096 bytes get a zero test built for that very size: a loop of known length,
+// unrolled over 16-byte vectors; any other size goes through the generic loop
+// Block copies are left to memcpy, a hand-unrolled copy measured no faster, see the kernel table of benchmark
+typedef struct {
+    size_t blockSize;
+    size_t fanout;   /* pointers held by an indirect block, computed once rather than divided per block */
+    int shift;       /* log2 of blockSize, -1 if it is not a power of two */
+    int specialised; /* non-zero if the zero test below is built for blockSize */
+    int (*isZero)(const void *block, size_t blockSize); /* non-zero if the block holds zero bytes only */
+} blockKernels;
+
+void selectKernels(blockKernels *kernels, size_t blockSize, int generic);
+
+void *allocBlocks(size_t count, size_t blockSize);
+
+#endif //P5_BLOCKS_H
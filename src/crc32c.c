@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78 /* reflected Castagnoli polynomial */
+
+static uint32_t table[256];
+static int ready = 0; // 1 once table is filled, 2 if hardware crc32 is used instead
+static pthread_once_t readyOnce = PTHREAD_ONCE_INIT; // threads hashing at once pick the implementation once
+
+/**
+ * Software fallback, one byte at a time through a 256 entry table
+ */
+static uint32_t crc32cTable(uint32_t crc, const unsigned char *p, size_t length) {
+    while (length-- > 0) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+/**
+ * SSE4.2 version, eight bytes per crc32 instruction, the unaligned head and tail go one byte at a time
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *p, size_t length) {
+    uint64_t value = crc;
+    for (; length > 0 && ((uintptr_t) p & 7) != 0; length--) {
+        value = _mm_crc32_u8((uint32_t) value, *p++);
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    for (; length > 0; length--) {
+        value = _mm_crc32_u8((uint32_t) value, *p++);
+    }
+    return (uint32_t) value;
+}
+#endif
+
+/**
+ * Pick the implementation on first use, the table is only built when the hardware one is not available
+ */
+static void crc32cInit() {
+    uint32_t i, k, crc;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        ready = 2;
+        return;
+    }
+#endif
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        table[i] = crc;
+    }
+    ready = 1;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&readyOnce, crc32cInit);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (ready == 2) {
+        return ~crc32cHardware(crc, data, length);
+    }
+#endif
+    return ~crc32cTable(crc, data, length);
+}
@@ -0,0 +1,11 @@
+#ifndef P5_CRC32C_H
+#define P5_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has it, a table otherwise
+// Start with crc 0, and feed the result of one call into the next to checksum a stream piece by piece
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif //P5_CRC32C_H
@@ -1,35 +1,192 @@
+#define _GNU_SOURCE // copy_file_range
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "blocks.h"
+#include "crc32c.h"
 #include "defrag.h"
+#include "uring.h"
 
-/**** Following variables and constant are used to store general information of the target file system ****/
-int d_error; // error type descriptor, use bitwise operation
+size_t inodeSize = 100; // i-node size, not use sizeof operator to avoid cross-platform problem
 
-// initial offset in byte of three regions
-size_t inodeInitial;
-size_t dataInitial;
-size_t swapInitial;
+#define COPY_WINDOW_BYTES   (1 << 20)  // staging size of the source-ordered copy pass
+#define URING_DEPTH         128        // io_uring queue depth, requests in flight at most
+#define STREAM_MEMORY_BYTES (64 << 20) // reorder buffer streamDefragmenter keeps in memory by default
+#define CHECKPOINT_BYTES    (256 << 20) // input swept by copy pass between two checkpoints of relocation map
+
+#define MAX_DEPTH 3 // deepest indirect tree, rooted at i3block
+#define N_ROOTS (N_DBLOCKS + N_IBLOCKS + 2) // pointer fields of an inode, see inodeRoots
+
+// output position of a file while it is planned
+typedef struct {
+    int start;       /* first output block of the file, sources are indexed from there */
+    int next;        /* next output block to be claimed */
+    int nextIndirect; /* next output block for an indirect block, -1 to place them among data blocks */
+    int *sources;    /* input index of every claimed block in claim order, -1 if lost, NULL if not recorded */
+    size_t count;    /* number of claimed blocks recorded in sources */
+    size_t capacity; /* number of blocks sources can hold */
+    int mode;        /* one of PLAN_* */
+} planCursor;
+
+// metadata of an image in struct-of-arrays form, loaded once by loadIndex and indexBlocks, then queried by every tool
+typedef struct {
+    dev_t device;       /* identity of the image it is loaded from */
+    ino_t file;
+    size_t inodeCount;
+    int *size;          /* file size of every inode in bytes */
+    int *nlink;         /* link count of every inode, 0 or less for a free one */
+    size_t *firstBlock; /* blocks of inode i are blocks[firstBlock[i]] up to blocks[firstBlock[i + 1]] */
+    int *blocks;        /* every block of every live file, indirect ones included, in the order planTree takes them */
+} metaIndex;
+
+#define PLAN_SEQUENTIAL 0 /* blocks of the file are given consecutive locations from next */
+#define PLAN_IDENTITY   1 /* blocks of the file keep their current locations */
+#define PLAN_SURVEY     2 /* blocks are only recorded into sources, nothing is claimed */
+
+#define IO_MEMORY       0 /* transfer on mapped images, no request involved */
+#define IO_REQUEST      1 /* transfer sent to the kernel as a request of its own */
+#define IO_SAME_REQUEST 2 /* other side of a request already counted, e.g. copy_file_range */
+
+/**** Following fields are used to store general information of the target file system ****/
+struct defragContext {
+    defragOptions options;
+    int error; // error type descriptor, use bitwise operation
+
+    // initial offset in byte of three regions, 64-bit even where size_t is not
+    off_t inodeInitial;
+    off_t dataInitial;
+    off_t swapInitial;
+
+    superblock *superBlock; // pointer to super-block
+    size_t blockSize;       // default block size, always true for boot and super block
+    blockKernels kernels;   // copy, zero test and fanout picked for blockSize, see selectKernels
+
+    // relative to data region, used to trace the next location to be filled into output file
+    int dataBlockIndex;
+
+    // memory-mapped images, only valid when engine is ENGINE_MMAP
+    char *inMap;
+    char *outMap;
+    size_t mapLength;
+    void *copyBuffer; // shared block buffer used by the stdio engine, allocated once per image
+
+    // relocation plan, built by planAllFiles before a single block is copied
+    int dataRegion;                // number of blocks in data region
+    int *relocation;               // old data block index -> new index, -1 if no file references it
+    unsigned short *pointerCount;  // live pointers held by an indirect block, 0 for plain data blocks
+    inode *inodeTable;             // whole inode region, rewritten in memory while planning
+    int *fileStart;                // first output block of every inode, see layoutFiles
+    size_t inodeRegionSize;        // inode region length in bytes
+    metaIndex index;               // sizes, links and block lists of input image, see loadIndex
+
+    // incremental mode, see layoutIncremental
+    char *usedMap; // 1 for every output block taken by a file, free space is what remains
+
+    // relocation map of defragmenter, which checkpoints its copy pass as well, see createMap
+    FILE *mapFile;       // NULL if the run keeps no map
+    relocationMap map;   // header of mapFile as last saved
+    int nextCheckpoint;  // input block copy pass saves its next checkpoint at
+
+    // statistics, see countIo and statPhase
+    runStats stats;
+    off_t lastEnd[2];  // end of the last read and write request, to tell seeks
+    double phaseMark;  // time the running phase started
+
+    // concurrent copy, see copyFilesConcurrently
+    size_t nextInode; // next inode to be taken by a worker
+
+    // byte offsets of each part inside in-place journal, derived from its header, see locateJournalParts
+    off_t journalMetaOffset;
+    off_t journalIndirectOffset;
+    off_t journalFreeOffset;
+    off_t journalMoveOffset;
+    off_t journalScratchOffset;
+    off_t journalBatchOffset;
+};
+
+// used ahead of their definitions by context and debug functions
+int loadIndex(defragContext *ctx, FILE *in);
+
+inode *inodeAt(defragContext *ctx, size_t i);
+
+void readAt(defragContext *ctx, FILE *in, off_t offset, void *buffer, size_t length);
+
+void releasePlan(defragContext *ctx);
 
-superblock *superBlock; // pointer to super-block
-size_t blockSize = 512; // default block size, always true for boot and super block
-size_t inodeSize = 100; // i-node size, not use sizeof operator to avoid cross-platform problem
+/**
+ * Options of a plain run: stdio engine, single pass, inode order, full rewrite
+ */
+void defaultOptions(defragOptions *options) {
+    memset(options, 0, sizeof(defragOptions));
+    options->engine = ENGINE_STDIO;
+    options->threads = 1;
+    options->layout = LAYOUT_INODE;
+    options->streamMemory = STREAM_MEMORY_BYTES;
+}
+
+/**
+ * Create the context of one image, see defrag.h
+ * @param options Options of the runs, copied, NULL for defaultOptions
+ * @return The context, to be released with destroyContext
+ */
+defragContext *createContext(const defragOptions *options) {
+    defragContext *ctx = calloc(1, sizeof(defragContext));
+    if (options != NULL) {
+        ctx->options = *options;
+    } else {
+        defaultOptions(&ctx->options);
+    }
+    ctx->blockSize = DEFAULT_BLOCK_SIZE;
+    selectKernels(&ctx->kernels, ctx->blockSize, 0);
+    return ctx;
+}
+
+void destroyContext(defragContext *ctx) {
+    releasePlan(ctx); // metadata index a tool may have left for the next one
+    free(ctx);
+}
+
+/**
+ * Error flags of the last run, ERROR_* combined
+ */
+int contextError(const defragContext *ctx) {
+    return ctx->error;
+}
 
-// the following three indexes are relative to data region
-// used to trace the next location to be filled into output file
-int dataBlockIndex = 0;
-int freeBlockIndex = 0;
+/**
+ * Statistics accumulated by every run over the context so far
+ */
+const runStats *contextStats(const defragContext *ctx) {
+    return &ctx->stats;
+}
+
+/**
+ * Byte offset of data block blk, computed in 64 bits so images may exceed what size_t or int can address
+ */
+off_t blockOffset(defragContext *ctx, int blk) {
+    return ctx->dataInitial + (off_t) blk * ctx->blockSize;
+}
 
 /******* Following functions are used for debug purpose, not necessarily as a part of defragmenter *******/
 
-void dumpBootBlock(const char *bootBlock) {
+void dumpBootBlock(defragContext *ctx, const char *bootBlock) {
     int i;
     printf("Boot Block Status:\n");
-    for (i = 0; i < blockSize; i++) {
+    for (i = 0; i < DEFAULT_BLOCK_SIZE; i++) {
         putchar(*(bootBlock + i));
     }
     putchar('\n');
     putchar('\n');
 }
 
-void dumpSuperBlock(superblock *superBlock) {
+void dumpSuperBlock(defragContext *ctx, superblock *superBlock) {
+    if (!ctx->options.verbose) {
+        return;
+    }
     printf("Super Block Status:\n");
     printf("Size:         %d\n", superBlock->size);
     printf("Inode offset: %d\n", superBlock->inode_offset);
@@ -67,33 +224,31 @@ void dumpInode(inode *inode) {
     printf("\n");
 }
 
-void dumpInodeFreeList(FILE *in) {
+/**
+ * Print every inode of the free inode list, taken from metadata index, the walk stops at a link out of inode region
+ * or after every inode is seen once, so a corrupted list cannot loop
+ */
+void dumpInodeFreeList(defragContext *ctx) {
+    size_t steps;
+    int next = ctx->superBlock->free_inode;
     printf("Inode Free List:\n");
-
-    inode *next = malloc(inodeSize);
-    fseek(in, inodeInitial + superBlock->free_inode * inodeSize, SEEK_SET);
-    fread(next, 1, inodeSize, in);
-    while (next->next_inode >= 0) {
-        dumpInode(next);
-        fseek(in, inodeInitial + next->next_inode * inodeSize, SEEK_SET);
-        fread(next, 1, inodeSize, in);
+    for (steps = 0; next >= 0 && next < ctx->index.inodeCount && steps < ctx->index.inodeCount; steps++) {
+        dumpInode(inodeAt(ctx, next));
+        next = inodeAt(ctx, next)->next_inode;
     }
-    dumpInode(next);
-
-    free(next);
 }
 
-void dumpDataFreeList(FILE *in) {
+void dumpDataFreeList(defragContext *ctx, FILE *in) {
     printf("Data Free List:\n");
-    printf("Head index: %d\n", superBlock->free_iblock);
+    printf("Head index: %d\n", ctx->superBlock->free_iblock);
 
-    void *next = malloc(blockSize);
-    fseek(in, dataInitial + superBlock->free_iblock * blockSize, SEEK_SET);
-    fread(next, blockSize, 1, in);
+    void *next = malloc(ctx->blockSize);
+    fseeko(in, blockOffset(ctx, ctx->superBlock->free_iblock), SEEK_SET);
+    fread(next, ctx->blockSize, 1, in);
     int value = *((int *) next);
     while (value >= 0) {
-        fseek(in, dataInitial + value * blockSize, SEEK_SET);
-        fread(next, blockSize, 1, in);
+        fseeko(in, blockOffset(ctx, value), SEEK_SET);
+        fread(next, ctx->blockSize, 1, in);
         printf("Next index: %d\n", value);
         value = *((int *) next);
     }
@@ -106,448 +261,3688 @@ void dumpDataFreeList(FILE *in) {
  * This function print boot, super and all inode block content
  * Also print full free data and inode list
  * If the result is legal, at least the format of input file image is correct
+ * Super block and inodes come from metadata index, loaded here unless printFiles already did for this image
  * @param inFile Pointer to a file need to be validated
  */
-void validator(FILE *inFile) {
-    rewind(inFile);
-    void *buffer = malloc(blockSize);
-
-    // dump boot block
-    fread(buffer, blockSize, 1, inFile);
-    dumpBootBlock(buffer);
-
-    // dump super block
-    superBlock = malloc(blockSize);
-    fread(superBlock, blockSize, 1, inFile);
-    dumpSuperBlock(superBlock);
-    blockSize = (size_t) superBlock->size;
+void validator(defragContext *ctx, FILE *inFile) {
+    char bootBlock[DEFAULT_BLOCK_SIZE];
+    size_t i;
+    if (loadIndex(ctx, inFile) != 0) {
+        return;
+    }
 
-    // calculate initial address of three areas
-    inodeInitial = (2 + superBlock->inode_offset) * blockSize;
-    dataInitial = (2 + superBlock->data_offset) * blockSize;
-    swapInitial = (2 + superBlock->swap_offset) * blockSize;
+    // dump boot and super block
+    readAt(ctx, inFile, 0, bootBlock, DEFAULT_BLOCK_SIZE);
+    dumpBootBlock(ctx, bootBlock);
+    dumpSuperBlock(ctx, ctx->superBlock);
 
     // dump free lists
-    dumpInodeFreeList(inFile);
-    dumpDataFreeList(inFile);
+    dumpInodeFreeList(ctx);
+    dumpDataFreeList(ctx, inFile);
 
     // dump all inodes
     printf("\nInode List:\n");
-    int i;
-    inode *inodeBuffer = malloc(inodeSize);
-    size_t inodeCount = (superBlock->data_offset - superBlock->inode_offset) * blockSize / inodeSize;
-    for (i = 0; i < inodeCount; i++) {
-        fseek(inFile, inodeInitial + i * inodeSize, SEEK_SET);
-        fread(inodeBuffer, 1, inodeSize, inFile);
-        dumpInode(inodeBuffer);
+    for (i = 0; i < ctx->index.inodeCount; i++) {
+        dumpInode(inodeAt(ctx, i));
     }
-    free(inodeBuffer);
-
-    free(buffer);
-    free(superBlock);
 }
 
 /**
  * This function print separated files from input file image
- * Output files will be placed in sub-folder ./unpacked of execution directory
+ * Output files will be placed in sub-folder ./unpacked of execution directory, see extractor
  * If the input file image is correct, output files can be normally open in Ubuntu system
- * Note that this function **cannot** handle files with second or third indirect blocks for convenience
+ * Metadata index stays loaded in the context, so validator over the same image does not read it again
  * @param inFile Pointer to a input file image
  */
-void printFiles(FILE *inFile) {
-    rewind(inFile);
-    void *buffer = malloc(blockSize);
+void printFiles(defragContext *ctx, FILE *inFile) {
+    size_t i;
+    if (loadIndex(ctx, inFile) != 0) {
+        return;
+    }
 
-    // read boot block
-    fread(buffer, blockSize, 1, inFile);
+    // dump inode free lists
+    dumpInodeFreeList(ctx);
 
-    // read super block
-    superBlock = malloc(blockSize);
-    fread(superBlock, blockSize, 1, inFile);
-    blockSize = (size_t) superBlock->size;
+    for (i = 0; i < ctx->index.inodeCount; i++) {
+        dumpInode(inodeAt(ctx, i));
+    }
 
-    // calculate initial address of three areas
-    inodeInitial = (2 + superBlock->inode_offset) * blockSize;
-    dataInitial = (2 + superBlock->data_offset) * blockSize;
-    swapInitial = (2 + superBlock->swap_offset) * blockSize;
+    extractor(ctx, inFile, "unpacked", 1);
+}
 
-    // dump inode free lists
-    dumpInodeFreeList(inFile);
+/*********************** From there, functions are parts of run statistics ***********************/
 
-    int i, j, k;
-    inode *inodeBuffer = malloc(inodeSize);
-    size_t inodeCount = (superBlock->data_offset - superBlock->inode_offset) * blockSize / inodeSize;
-    FILE *outFile;
-    char name[50];
-    int *inBuffer = malloc(blockSize);
-    for (i = 0; i < inodeCount; i++) {
-        fseek(inFile, inodeInitial + i * inodeSize, SEEK_SET);
-        fread(inodeBuffer, 1, inodeSize, inFile);
-        dumpInode(inodeBuffer);
-        mkdir("unpacked", S_IRWXU);
-        if (inodeBuffer->nlink > 0) {
-            sprintf(name, "unpacked/file-%d", i);
-            outFile = fopen(name, "wt");
-            size_t dataCount = ((inodeBuffer->size - 1) / blockSize) + 1;
-            for (j = 0; j < N_DBLOCKS; j++) {
-                if (dataCount <= 0) {
-                    break;
-                }
-                fseek(inFile, dataInitial + inodeBuffer->dblocks[j] * blockSize, SEEK_SET);
-                fread(buffer, blockSize, 1, inFile);
-                if (dataCount > 1) {
-                    fwrite(buffer, blockSize, 1, outFile);
-                } else {
-                    fwrite(buffer, inodeBuffer->size % blockSize, 1, outFile);
-                }
-                dataCount--;
-            }
-            for (j = 0; j < N_IBLOCKS; j++) {
-                if (dataCount <= 0) {
-                    break;
-                }
-                fseek(inFile, dataInitial + inodeBuffer->iblocks[j] * blockSize, SEEK_SET);
-                fread(inBuffer, blockSize, 1, inFile);
-                for (k = 0; k < (blockSize / sizeof(int)); k++) {
-                    if (dataCount <= 0) {
-                        break;
-                    }
-                    fseek(inFile, dataInitial + inBuffer[k] * blockSize, SEEK_SET);
-                    fread(buffer, blockSize, 1, inFile);
-                    if (dataCount > 1) {
-                        fwrite(buffer, blockSize, 1, outFile);
-                    } else {
-                        fwrite(buffer, inodeBuffer->size % blockSize, 1, outFile);
-                    }
-                    dataCount--;
-                }
-            }
-            fclose(outFile);
-        }
+/**
+ * Account a transfer into statistics of the context, safe to be called from several threads at once
+ * @param write 0 for a read, 1 for a write
+ * @param kind One of IO_*
+ */
+void countIo(defragContext *ctx, int write, off_t offset, size_t length, int kind) {
+    __sync_fetch_and_add(write ? &ctx->stats.bytesWritten : &ctx->stats.bytesRead, length);
+    if (kind == IO_MEMORY) {
+        return;
     }
+    if (kind == IO_REQUEST) {
+        __sync_fetch_and_add(&ctx->stats.requests, 1);
+    }
+    off_t last = __sync_lock_test_and_set(&ctx->lastEnd[write], offset + length);
+    if (last != offset) {
+        size_t distance = (last > offset ? last - offset : offset - last) >> 10;
+        int bucket = 0;
+        for (; distance > 1 && bucket < SEEK_BUCKETS - 1; distance >>= 1, bucket++);
+        __sync_fetch_and_add(&ctx->stats.seeks, 1);
+        __sync_fetch_and_add(&ctx->stats.seekHistogram[bucket], 1);
+    }
+}
+
+double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-    free(inBuffer);
-    free(inodeBuffer);
+/**
+ * Start timing, the time until next statPhase is charged to the phase named there
+ */
+void statMark(defragContext *ctx) {
+    ctx->phaseMark = monotonicSeconds();
+}
 
-    free(buffer);
-    free(superBlock);
+/**
+ * Charge the time since last statMark or statPhase to phase, and start timing the next one
+ */
+void statPhase(defragContext *ctx, int phase) {
+    double now = monotonicSeconds();
+    ctx->stats.seconds[phase] += now - ctx->phaseMark;
+    ctx->phaseMark = now;
+}
+
+/**
+ * Print statistics of the context as a JSON object
+ */
+void printStats(defragContext *ctx, FILE *out) {
+    static const char *names[PHASE_COUNT] = {"load", "plan", "copy", "inodes", "free_list", "swap", "sync",
+                                             "journal", "finish", "verify"};
+    static const char *engines[] = {"stdio", "mmap", "uring"};
+    int i;
+    double total = 0;
+    fprintf(out, "{\n  \"engine\": \"%s\",\n  \"threads\": %d,\n  \"error\": %d,\n  \"phases\": {",
+            engines[ctx->options.engine], ctx->options.threads, ctx->error);
+    for (i = 0; i < PHASE_COUNT; i++) {
+        fprintf(out, "%s\n    \"%s\": %.6f", i > 0 ? "," : "", names[i], ctx->stats.seconds[i]);
+        total += ctx->stats.seconds[i];
+    }
+    fprintf(out, "\n  },\n  \"seconds\": %.6f,\n", total);
+    fprintf(out, "  \"requests\": %zu,\n  \"seeks\": %zu,\n", ctx->stats.requests, ctx->stats.seeks);
+    fprintf(out, "  \"bytes_read\": %zu,\n  \"bytes_written\": %zu,\n", ctx->stats.bytesRead, ctx->stats.bytesWritten);
+    fprintf(out, "  \"bytes_spilled\": %zu,\n", ctx->stats.bytesSpilled);
+    fprintf(out, "  \"seek_histogram_kib\": [");
+    for (i = 0; i < SEEK_BUCKETS; i++) {
+        fprintf(out, "%s%zu", i > 0 ? ", " : "", ctx->stats.seekHistogram[i]);
+    }
+    fprintf(out, "]\n}\n");
 }
 
 /*********************** From there, functions are parts of our defragmenter ***********************/
 
 /**
- * This function read origin superblock and inode,
- * then copy them to output file as a kind of placeholder
- * After operation, the cursor of output file should at the beginning of data area
- * Notice this function should be called just after boot block have been written into out file
- * Also note that superblock must be initialized before calling it
- * @param out The output file pointer
+ * Tell if block starts with a whole block of zero bytes, a partial block never counts as zero
  */
-void copyInodes(FILE *in, FILE *out) {
-    int i;
-    void *buffer = malloc(blockSize);
+int isZeroBlock(defragContext *ctx, const char *block, size_t length) {
+    return length >= ctx->blockSize && ctx->kernels.isZero(block, ctx->blockSize);
+}
 
-    // copy origin superblock as placeholder
-    fwrite(superBlock, blockSize, 1, out);
+/**
+ * Length in bytes of the run of blocks at the start of buffer which are all zero, or all hold data
+ * @param zero Set to 1 if the run is zero, 0 otherwise
+ */
+size_t sparseRun(defragContext *ctx, const char *buffer, size_t length, int *zero) {
+    size_t run;
+    *zero = isZeroBlock(ctx, buffer, length);
+    for (run = ctx->blockSize; run < length &&
+            isZeroBlock(ctx, buffer + run, length - run) == *zero; run += ctx->blockSize);
+    return run < length ? run : length;
+}
 
-    // copy origin inodes to output file, also as placeholder
-    for (i = superBlock->inode_offset; i < superBlock->data_offset; i++) {
-        fseek(in, inodeInitial + i * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, in);
-        fseek(out, inodeInitial + i * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, out);
-    }
+/**
+ * Flag a transfer that did not move all its bytes, safe to be called from several threads at once
+ * Whatever the cause, a block of output is missing or stale, so the run cannot be trusted
+ */
+void transferFailed(defragContext *ctx) {
+    __sync_fetch_and_or(&ctx->error, ERROR_DATA_BLOCK_LOST);
+}
 
-    free(buffer);
+/**
+ * Tell whether length bytes at offset lie inside the mapped images, see mapImages
+ */
+int insideMap(defragContext *ctx, off_t offset, size_t length) {
+    return offset >= 0 && (size_t) offset <= ctx->mapLength && length <= ctx->mapLength - (size_t) offset;
 }
 
 /**
- * This function sort free data block indexes,
- * and write them in ascending order into output file
- * @param inFile The input file pointer
- * @param outFile The output file pointer
+ * Store length bytes at offset of output image, positional stores are safe to be issued from several threads
+ * In sparse mode whole zero blocks are skipped and left as holes,
+ * which is only correct because the output image is created empty, so a block never stored reads back as zero
+ * A store that does not land in full flags the run, see transferFailed
  */
-void writeFreeDataBlock(FILE *inFile, FILE *outFile) {
-    size_t cnt = 0; // number of data region free blocks
-
-    // count free data block number
-    int i, next;
-    fseek(inFile, dataInitial + superBlock->free_iblock * blockSize, SEEK_SET);
-    fread(&next, 1, sizeof(int), inFile);
-    cnt++;
-    while (next >= 0) {
-        fseek(inFile, dataInitial + next * blockSize, SEEK_SET);
-        fread(&next, 1, sizeof(int), inFile);
-        cnt++;
-    }
-    int *arr = malloc(sizeof(int) * (cnt + 1));
-
-    // read inFile free block indexes
-    cnt = 0;
-    fseek(inFile, dataInitial + superBlock->free_iblock * blockSize, SEEK_SET);
-    arr[cnt++] = superBlock->free_iblock;
-    fread(arr + cnt, sizeof(int), 1, inFile);
-    while (arr[cnt] >= 0) {
-        fseek(inFile, dataInitial + arr[cnt] * blockSize, SEEK_SET);
-        cnt++;
-        fread(arr + cnt, sizeof(int), 1, inFile);
-    }
-
-    // write free blocks to output file in ascending order
-    freeBlockIndex = dataBlockIndex;
-    superBlock->free_iblock = freeBlockIndex;
-    fseek(outFile, dataInitial + freeBlockIndex * blockSize, SEEK_SET);
-    void *buffer = malloc(blockSize);
-    memset(buffer, 0, blockSize);
-    for (i = 0; i < cnt - 1; i++) {
-        fseek(inFile, dataInitial + arr[i] * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        *(int *) buffer = ++freeBlockIndex;
-        fwrite(buffer, blockSize, 1, outFile);
-    }
-
-    fseek(inFile, dataInitial + arr[cnt - 1] * blockSize, SEEK_SET);
-    fread(buffer, blockSize, 1, inFile);
-    *(int *) buffer = -1;
-    fwrite(buffer, blockSize, 1, outFile);
-    freeBlockIndex++;
-
-    free(arr);
-    free(buffer);
+void storeAt(defragContext *ctx, FILE *out, off_t offset, const char *buffer, size_t length, int positional) {
+    size_t done, run;
+    int zero = 0;
+    for (done = 0; done < length; done += run) {
+        run = ctx->options.sparse ? sparseRun(ctx, buffer + done, length - done, &zero) : length;
+        if (zero) {
+            continue;
+        }
+        countIo(ctx, 1, offset + done, run, ctx->outMap != NULL ? IO_MEMORY : IO_REQUEST);
+        if (ctx->outMap != NULL) {
+            if (!insideMap(ctx, offset + done, run)) {
+                transferFailed(ctx);
+                return;
+            }
+            memcpy(ctx->outMap + offset + done, buffer + done, run);
+        } else if (positional) {
+            if (pwrite(fileno(out), buffer + done, run, offset + done) != (ssize_t) run) {
+                transferFailed(ctx);
+            }
+        } else if (fseeko(out, offset + done, SEEK_SET) != 0 || fwrite(buffer + done, run, 1, out) != 1) {
+            transferFailed(ctx);
+        }
+    }
 }
 
 /**
- * This function simply copy swap region from input to output file
+ * The following three functions are the only places our defragmenter touches image content
+ * With ENGINE_STDIO they seek and read/write through the FILE pointers,
+ * with ENGINE_MMAP they work on the mapped images directly and the FILE pointers are ignored
+ * All offsets are in bytes from the very beginning of the image
+ * Bytes a read cannot get, past the end of the image or on an I/O error, read as zeros and flag the run
  */
-void writeSwapRegion(FILE *inFile, FILE *outFile) {
-    if (fseek(outFile, swapInitial, SEEK_SET)) { // cannot direct to swap region
-        d_error |= ERROR_CORRUPTED_SWAP_REGION;
+void readAt(defragContext *ctx, FILE *in, off_t offset, void *buffer, size_t length) {
+    countIo(ctx, 0, offset, length, ctx->inMap != NULL ? IO_MEMORY : IO_REQUEST);
+    if (ctx->inMap != NULL) {
+        if (!insideMap(ctx, offset, length)) {
+            memset(buffer, 0, length);
+            transferFailed(ctx);
+            return;
+        }
+        memcpy(buffer, ctx->inMap + offset, length);
         return;
     }
-
-    void *buffer = malloc(blockSize);
-    fseek(inFile, swapInitial, SEEK_SET);
-    while (fread(buffer, blockSize, 1, inFile)) {
-        fwrite(buffer, blockSize, 1, outFile);
+    size_t done = fseeko(in, offset, SEEK_SET) == 0 ? fread(buffer, 1, length, in) : 0;
+    if (done < length) {
+        memset((char *) buffer + done, 0, length - done);
+        transferFailed(ctx);
     }
+}
 
-    free(buffer);
+void writeAt(defragContext *ctx, FILE *out, off_t offset, const void *buffer, size_t length) {
+    storeAt(ctx, out, offset, buffer, length, 0);
 }
 
 /**
- * This function read a I1 block, and print all blocks indexed by it to output file
- * The I1 block indicated by blk will be updated
- * Also decrease dataCount, which count for remaining data blocks for this file
+ * Copy length bytes from offset from of input image to offset to of output image
+ * In mmap mode this is a single memcpy from map to map, no intermediate buffer involved
+ * Note length should not exceed blockSize when using stdio engine
  */
-void writeIndirectBlock(int *blk, FILE *inFile, FILE *outFile, size_t *dataCount) {
-    int i;
-    void *buffer = malloc(blockSize);
-    for (i = 0; i < (blockSize / sizeof(int)); i++) {
-        if (*dataCount <= 0) {
-            break;
+void copyAt(defragContext *ctx, FILE *in, FILE *out, off_t from, off_t to, size_t length) {
+    if (ctx->inMap != NULL && ctx->outMap != NULL) {
+        countIo(ctx, 0, from, length, IO_MEMORY);
+        if (!insideMap(ctx, from, length)) {
+            transferFailed(ctx);
+            return;
         }
-
-        fseek(inFile, dataInitial + blk[i] * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        blk[i] = dataBlockIndex++;
-        fseek(outFile, dataInitial + blk[i] * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, outFile);
-        (*dataCount)--;
+        writeAt(ctx, out, to, ctx->inMap + from, length);
+        return;
     }
-    free(buffer);
+    readAt(ctx, in, from, ctx->copyBuffer, length);
+    writeAt(ctx, out, to, ctx->copyBuffer, length);
 }
 
 /**
- * This function read a I2 block, and print all blocks indexed by it to output file
- * The I2 block indicated by blk will be updated
- * Also decrease dataCount, which count for remaining data blocks for this file
+ * Copy a span of input image into output image inside the kernel with copy_file_range,
+ * on filesystems with reflink (XFS, btrfs) the span shares extents with input and nothing is copied at all
+ * When the kernel cannot do it, e.g. images on different filesystems, the rest goes block by block through copyAt
  */
-void writeSecondIndirectBlock(int *blk, FILE *inFile, FILE *outFile, size_t *dataCount) {
-    int i;
-    void* buffer = malloc(blockSize);
-    for (i = 0; i < (blockSize / sizeof(int)); i++) {
-        if (*dataCount <= 0) {
-            break;
+void copyRange(defragContext *ctx, FILE *in, FILE *out, off_t from, off_t to, size_t length) {
+    loff_t src = (loff_t) from, dst = (loff_t) to;
+    ssize_t done = 1;
+    fflush(out);
+    while (length > 0 && done > 0) {
+        done = copy_file_range(fileno(in), &src, fileno(out), &dst, length, 0);
+        if (done > 0) {
+            countIo(ctx, 0, src - done, done, IO_REQUEST);
+            countIo(ctx, 1, dst - done, done, IO_SAME_REQUEST);
+            length -= done;
         }
-
-        fseek(inFile, dataInitial + blk[i] * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        blk[i] = dataBlockIndex++;
-        writeIndirectBlock(blk, inFile, outFile, dataCount);
-        fseek(outFile, dataInitial + blk[i] * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, outFile);
     }
-    free(buffer);
+    if (done == 0) { // input ends here
+        return;
+    }
+    for (; length > 0; length -= done, src += done, dst += done) {
+        done = length < ctx->blockSize ? length : ctx->blockSize;
+        copyAt(ctx, in, out, src, dst, done);
+    }
 }
 
 /**
- * This function read a I3 block, and print all blocks indexed by it to output file
- * The I3 block indicated by blk will be updated
- * Also decrease dataCount, which count for remaining data blocks for this file
+ * Positional counterparts of readAt and writeAt, safe to be called from several threads at once
+ * They never move the FILE cursor, so buffered output must be flushed before they are used
  */
-void writeThirdIndirectBlock(int *blk, FILE *inFile, FILE *outFile, size_t *dataCount) {
-    int i;
-    void* buffer = malloc(blockSize);
-    for (i = 0; i < (blockSize / sizeof(int)); i++) {
-        if (*dataCount <= 0) {
-            break;
+void preadAt(defragContext *ctx, FILE *in, off_t offset, void *buffer, size_t length) {
+    countIo(ctx, 0, offset, length, ctx->inMap != NULL ? IO_MEMORY : IO_REQUEST);
+    if (ctx->inMap != NULL) {
+        if (!insideMap(ctx, offset, length)) {
+            memset(buffer, 0, length);
+            transferFailed(ctx);
+            return;
         }
-
-        fseek(inFile, dataInitial + blk[i] * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        blk[i] = dataBlockIndex++;
-        writeSecondIndirectBlock(blk, inFile, outFile, dataCount);
-        fseek(outFile, dataInitial + blk[i] * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, outFile);
+        memcpy(buffer, ctx->inMap + offset, length);
+        return;
     }
-    free(buffer);
+    ssize_t done = pread(fileno(in), buffer, length, offset);
+    if (done < 0 || (size_t) done < length) {
+        done = done < 0 ? 0 : done;
+        memset((char *) buffer + done, 0, length - done);
+        transferFailed(ctx);
+    }
+}
+
+void pwriteAt(defragContext *ctx, FILE *out, off_t offset, const void *buffer, size_t length) {
+    storeAt(ctx, out, offset, buffer, length, 1);
 }
 
 /**
- * This function read a inode, and print all blocks of this file to output
- * Also modify pointer fields in input inode
+ * This function map input image read-only, and pre-size then map output image read-write
+ * If anything goes wrong, maps are released and we silently fall back to stdio engine
+ * @return 0 if both images are mapped, -1 otherwise
  */
-void writeSingleFile(inode *inode, FILE *inFile, FILE *outFile) {
-    int i;
-    void *buffer = malloc(blockSize);
-    size_t dataCount = ((inode->size - 1) / blockSize) + 1;
+int mapImages(defragContext *ctx, FILE *in, FILE *out) {
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0 || st.st_size == 0 || (off_t) (size_t) st.st_size != st.st_size) {
+        return -1; // an image larger than the address space goes through stdio
+    }
+    ctx->mapLength = (size_t) st.st_size;
 
-    // write direct blocks
-    for (i = 0; i < N_DBLOCKS; i++) {
-        if (dataCount <= 0) {
-            break;
-        }
-        fseek(inFile, dataInitial + inode->dblocks[i] * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        inode->dblocks[i] = dataBlockIndex++;
-        fseek(outFile, dataInitial + inode->dblocks[i] * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, outFile);
-        dataCount--;
+    ctx->inMap = mmap(NULL, ctx->mapLength, PROT_READ, MAP_SHARED, fileno(in), 0);
+    if (ctx->inMap == MAP_FAILED) {
+        ctx->inMap = NULL;
+        return -1;
     }
+    madvise(ctx->inMap, ctx->mapLength, MADV_WILLNEED);
 
-    // write indirect blocks
-    for (i = 0; i < N_IBLOCKS; i++) {
-        if (dataCount <= 0) {
-            break;
-        }
-        fseek(inFile, dataInitial + inode->iblocks[i] * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        //dumpIndexBlock(buffer);
-        inode->iblocks[i] = dataBlockIndex++;
-        writeIndirectBlock(buffer, inFile, outFile, &dataCount);
-        fseek(outFile, dataInitial + inode->iblocks[i] * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, outFile);
+    fflush(out);
+    if (ftruncate(fileno(out), ctx->mapLength) != 0) {
+        munmap(ctx->inMap, ctx->mapLength);
+        ctx->inMap = NULL;
+        return -1;
+    }
+    ctx->outMap = mmap(NULL, ctx->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out), 0);
+    if (ctx->outMap == MAP_FAILED) {
+        ctx->outMap = NULL;
+        munmap(ctx->inMap, ctx->mapLength);
+        ctx->inMap = NULL;
+        return -1;
     }
+    return 0;
+}
 
-    if (dataCount > 0) {
-        d_error |= ERROR_DATA_BLOCK_LOST;
-        perror("Not all blocks written!");
+void unmapImages(defragContext *ctx) {
+    if (ctx->outMap != NULL) {
+        msync(ctx->outMap, ctx->mapLength, MS_SYNC);
+        munmap(ctx->outMap, ctx->mapLength);
+        ctx->outMap = NULL;
+    }
+    if (ctx->inMap != NULL) {
+        munmap(ctx->inMap, ctx->mapLength);
+        ctx->inMap = NULL;
     }
+    ctx->mapLength = 0;
+}
+
 
-    if (inode->i2block != 0) {
-        fseek(inFile, dataInitial + inode->i2block, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        writeSecondIndirectBlock(buffer, inFile, outFile, &dataCount);
+/**
+ * Tell whether the regions a super block describes are in order and fit in an image of given size
+ * @param imageSize Length of the image in bytes, -1 if not known, e.g. for a stream
+ * @return 1 if the super block can be trusted, 0 otherwise
+ */
+int validSuperBlock(const superblock *super, off_t imageSize) {
+    if (super->size < DEFAULT_BLOCK_SIZE || super->size % sizeof(int) != 0 || super->inode_offset < 0 ||
+        super->data_offset < super->inode_offset || super->swap_offset < super->data_offset) {
+        return 0;
     }
+    return imageSize < 0 || 1024 + (off_t) super->swap_offset * super->size <= imageSize;
+}
 
-    if (inode->i3block != 0) {
-        fseek(inFile, dataInitial + inode->i3block, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        writeThirdIndirectBlock(buffer, inFile, outFile, &dataCount);
+/**
+ * This function read in the super block, then initialize block size and the initial address of three regions
+ * Regions are checked against the image size here, once, so no engine reads past its end later
+ * Kernels of this block size are picked here, once per image
+ * The super block is allocated by malloc, and should be freed by caller
+ * @param in The input file pointer
+ * @return 0 on success, -1 if the super block does not fit the image
+ */
+int loadSuperBlock(defragContext *ctx, FILE *in) {
+    struct stat st;
+    ctx->superBlock = calloc(1, DEFAULT_BLOCK_SIZE);
+    if (fstat(fileno(in), &st) != 0) {
+        return -1;
+    }
+    readAt(ctx, in, DEFAULT_BLOCK_SIZE, ctx->superBlock, DEFAULT_BLOCK_SIZE);
+    if (!validSuperBlock(ctx->superBlock, st.st_size)) {
+        return -1;
     }
+    ctx->blockSize = (size_t) ctx->superBlock->size;
+    selectKernels(&ctx->kernels, ctx->blockSize, 0);
 
-    free(buffer);
+    ctx->inodeInitial = 1024 + (off_t) ctx->superBlock->inode_offset * ctx->blockSize;
+    ctx->dataInitial = 1024 + (off_t) ctx->superBlock->data_offset * ctx->blockSize;
+    ctx->swapInitial = 1024 + (off_t) ctx->superBlock->swap_offset * ctx->blockSize;
+    return 0;
 }
 
 /**
- * This function write all files into output file in defragmented manner one by one
- * Note the inodeCount should be given as argument
+ * This function read the whole inode region into inodeTable with a single read
+ * Note that superblock must be initialized before calling it
+ * @param in The input file pointer
  */
-void writeAllFiles(FILE *inFile, FILE *outFile, size_t inodeCount) {
-    int i;
-    inode *inodeBuffer = malloc(inodeSize);
+void loadInodes(defragContext *ctx, FILE *in) {
+    ctx->inodeRegionSize = (ctx->superBlock->data_offset - ctx->superBlock->inode_offset) * ctx->blockSize;
+    ctx->inodeTable = malloc(ctx->inodeRegionSize);
+    readAt(ctx, in, ctx->inodeInitial, ctx->inodeTable, ctx->inodeRegionSize);
+}
+
+/**
+ * Locate the i-th inode in inodeTable, stepping by inodeSize rather than sizeof(inode)
+ */
+inode *inodeAt(defragContext *ctx, size_t i) {
+    return (inode *) ((char *) ctx->inodeTable + i * inodeSize);
+}
 
+/**
+ * Move live inodes to the front of inode region, in their current order, and link the slots left behind
+ * into a free inode list in ascending order; a free inode is zero-filled except for its next pointer
+ * Nothing on disk refers to an inode by its index, so only inode region and super block change
+ */
+void compactInodeTable(defragContext *ctx) {
+    size_t i, live = 0, inodeCount = ctx->inodeRegionSize / inodeSize;
+    char *table = calloc(1, ctx->inodeRegionSize);
+    memcpy(table + inodeCount * inodeSize, (char *) ctx->inodeTable + inodeCount * inodeSize,
+           ctx->inodeRegionSize - inodeCount * inodeSize); // bytes past the last whole inode
     for (i = 0; i < inodeCount; i++) {
-        fseek(inFile, inodeInitial + i * inodeSize, SEEK_SET);
-        fread(inodeBuffer, inodeSize, 1, inFile);
-        //dumpInode(inodeBuffer);
-        if (inodeBuffer->nlink > 0) {
-            writeSingleFile(inodeBuffer, inFile, outFile);
+        if (inodeAt(ctx, i)->nlink > 0) {
+            memcpy(table + live++ * inodeSize, inodeAt(ctx, i), inodeSize);
+        }
+    }
+    for (i = live; i < inodeCount; i++) {
+        ((inode *) (table + i * inodeSize))->next_inode = i + 1 < inodeCount ? (int) i + 1 : -1;
+    }
+    ctx->superBlock->free_inode = live < inodeCount ? (int) live : -1;
+    free(ctx->inodeTable);
+    ctx->inodeTable = (inode *) table;
+}
+
+/**
+ * This function write the (updated) inode region back to output file with a single write
+ * Free inodes are carried over unchanged, unless compactInodes option is set
+ * @param out The output file pointer
+ */
+void writeInodes(defragContext *ctx, FILE *out) {
+    writeAt(ctx, out, ctx->inodeInitial, ctx->inodeTable, ctx->inodeRegionSize);
+}
 
-            fseek(outFile, inodeInitial + i * inodeSize, SEEK_SET);
-            fwrite(inodeBuffer, inodeSize, 1, outFile);
+/**
+ * This function simply copy swap region from input to output file
+ */
+void writeSwapRegion(defragContext *ctx, FILE *inFile, FILE *outFile) {
+    if (ctx->options.sparse) { // leave the tail to kernel, then size output as input so trailing holes count
+        struct stat st;
+        if (fstat(fileno(inFile), &st) != 0 || ctx->swapInitial > st.st_size) {
+            ctx->error |= ERROR_CORRUPTED_SWAP_REGION;
+            return;
+        }
+        copyRange(ctx, inFile, outFile, ctx->swapInitial, ctx->swapInitial, st.st_size - ctx->swapInitial);
+        fflush(outFile);
+        if (ftruncate(fileno(outFile), st.st_size) != 0) {
+            ctx->error |= ERROR_CORRUPTED_SWAP_REGION;
+        }
+        return;
+    }
+    if (ctx->outMap != NULL) { // output is pre-sized to input length, copy the whole tail at once
+        if (ctx->swapInitial > ctx->mapLength) {
+            ctx->error |= ERROR_CORRUPTED_SWAP_REGION;
+            return;
         }
+        memcpy(ctx->outMap + ctx->swapInitial, ctx->inMap + ctx->swapInitial, ctx->mapLength - ctx->swapInitial);
+        countIo(ctx, 0, ctx->swapInitial, ctx->mapLength - ctx->swapInitial, IO_MEMORY);
+        countIo(ctx, 1, ctx->swapInitial, ctx->mapLength - ctx->swapInitial, IO_MEMORY);
+        return;
+    }
+
+    if (fseeko(outFile, ctx->swapInitial, SEEK_SET)) { // cannot direct to swap region
+        ctx->error |= ERROR_CORRUPTED_SWAP_REGION;
+        return;
+    }
+
+    off_t offset = ctx->swapInitial;
+    fseeko(inFile, ctx->swapInitial, SEEK_SET);
+    while (fread(ctx->copyBuffer, ctx->blockSize, 1, inFile)) {
+        fwrite(ctx->copyBuffer, ctx->blockSize, 1, outFile);
+        countIo(ctx, 0, offset, ctx->blockSize, IO_REQUEST);
+        countIo(ctx, 1, offset, ctx->blockSize, IO_REQUEST);
+        offset += ctx->blockSize;
     }
+}
 
-    free(inodeBuffer);
+/**
+ * Number of data blocks holding a file of given size
+ */
+size_t dataBlockCount(defragContext *ctx, int size) {
+    if (size <= 0) {
+        return 0;
+    }
+    return ctx->kernels.shift >= 0 ? ((size_t) size + ctx->blockSize - 1) >> ctx->kernels.shift :
+           ((size_t) size + ctx->blockSize - 1) / ctx->blockSize;
 }
 
 /**
- * This function works as a remedy for sample file error
- * Specifically, it copy all blocks remained (not data block nor free block) into output file
- * If this function is called, an error tag will be set
+ * Number of indirect blocks (I1, I2 and I3 levels) indexing a file of given size once defragmented
  */
-void dataRegionMender(FILE *inFile, FILE *outFile) {
+size_t indirectBlockCount(defragContext *ctx, int size) {
+    size_t fanout = ctx->kernels.fanout;
+    size_t remain = dataBlockCount(ctx, size);
+    size_t count = 0;
+    size_t chunk;
     int i;
-    int dataRegion = superBlock->swap_offset - superBlock->data_offset;
-    void *buffer = malloc(blockSize);
 
-    // 10135-10238 in test sample
-    for (i = freeBlockIndex; i < dataRegion; i++) {
-        d_error |= ERROR_CORRUPTED_FREE_DATA;
-        fseek(inFile, dataInitial + i * blockSize, SEEK_SET);
-        fread(buffer, blockSize, 1, inFile);
-        fseek(outFile, dataInitial + i * blockSize, SEEK_SET);
-        fwrite(buffer, blockSize, 1, outFile);
+    remain -= remain < N_DBLOCKS ? remain : N_DBLOCKS;
+    for (i = 0; i < N_IBLOCKS && remain > 0; i++) {
+        count++;
+        remain -= remain < fanout ? remain : fanout;
+    }
+    if (remain > 0) { // one I2 block and the I1 blocks below it
+        chunk = remain < fanout * fanout ? remain : fanout * fanout;
+        count += 1 + (chunk + fanout - 1) / fanout;
+        remain -= chunk;
     }
+    if (remain > 0) { // one I3 block, the I2 and I1 blocks below it, data beyond that is lost
+        chunk = remain < fanout * fanout * fanout ? remain : fanout * fanout * fanout;
+        count += 1 + (chunk + fanout * fanout - 1) / (fanout * fanout) + (chunk + fanout - 1) / fanout;
+    }
+    return count;
+}
 
-    free(buffer);
+/**
+ * Number of blocks (data plus all levels of indirect blocks) a file of given size occupies
+ * once defragmented, computed from its size only, without reading any indirect block
+ */
+size_t fileFootprint(defragContext *ctx, int size) {
+    size_t fanout = ctx->kernels.fanout;
+    size_t capacity = N_DBLOCKS + N_IBLOCKS * fanout + fanout * fanout + fanout * fanout * fanout;
+    size_t data = dataBlockCount(ctx, size);
+    return (data < capacity ? data : capacity) + indirectBlockCount(ctx, size); // data beyond I3 block is lost
+}
+
+/**
+ * List pointer fields of an inode, from direct blocks to I3 block, with the depth of tree each one roots
+ * @param roots Output, N_ROOTS pointers into inode
+ * @param depths Output, 0 for a data block up to 3 for I3 block
+ * @return Number of fields listed, always N_ROOTS
+ */
+int inodeRoots(inode *inode, int **roots, int *depths) {
+    int i, n = 0;
+    for (i = 0; i < N_DBLOCKS; i++, n++) {
+        roots[n] = &inode->dblocks[i];
+        depths[n] = 0;
+    }
+    for (i = 0; i < N_IBLOCKS; i++, n++) {
+        roots[n] = &inode->iblocks[i];
+        depths[n] = 1;
+    }
+    roots[n] = &inode->i2block;
+    depths[n++] = 2;
+    roots[n] = &inode->i3block;
+    depths[n++] = 3;
+    return n;
 }
 
-int defragmenter(FILE *inFile, FILE *outFile) {
-    void *buffer;
-    d_error = ERROR_ALL_GREEN;
-    buffer = malloc(DEFAULT_BLOCK_SIZE);
+/**
+ * Data blocks a tree rooted at given depth holds at most, i.e. fanout^depth
+ */
+size_t treeSpan(defragContext *ctx, int depth) {
+    size_t span = 1;
+    for (; depth > 0; depth--) {
+        span *= ctx->kernels.fanout;
+    }
+    return span;
+}
 
-    // simply copy boot block
-    fread(buffer, DEFAULT_BLOCK_SIZE, 1, inFile);
-    //dumpBootBlock(buffer);
-    fwrite(buffer, DEFAULT_BLOCK_SIZE, 1, outFile);
+/**
+ * Fill size and nlink arrays of metadata index from inodeTable, blocks are left to indexBlocks
+ */
+void indexInodes(defragContext *ctx) {
+    size_t i;
+    metaIndex *index = &ctx->index;
+    index->inodeCount = ctx->inodeRegionSize / inodeSize;
+    index->size = malloc(sizeof(int) * (index->inodeCount + 1));
+    index->nlink = malloc(sizeof(int) * (index->inodeCount + 1));
+    for (i = 0; i < index->inodeCount; i++) {
+        index->size[i] = inodeAt(ctx, i)->size;
+        index->nlink[i] = inodeAt(ctx, i)->nlink;
+    }
+}
+
+/**
+ * Tell whether the metadata index loaded in the context is the one of the image open at fd
+ */
+int indexDescribes(defragContext *ctx, int fd) {
+    struct stat status;
+    return fstat(fd, &status) == 0 && ctx->superBlock != NULL && ctx->index.size != NULL &&
+           ctx->index.device == status.st_dev && ctx->index.file == status.st_ino;
+}
 
-    // read in the super block
-    fread(buffer, DEFAULT_BLOCK_SIZE, 1, inFile);
-    superBlock = buffer;
-    dumpSuperBlock(superBlock);
+/**
+ * Load metadata index of an image: super block, then the whole inode region with a single read,
+ * and size and link count of every inode; indirect trees are left to indexBlocks
+ * An index already loaded from the same image is kept, so tools run one after another read metadata once
+ * @param in The input file pointer
+ * @return 0 on success, -1 if the super block does not fit the image, ERROR_DATA_BLOCK_LOST is set then
+ */
+int loadIndex(defragContext *ctx, FILE *in) {
+    struct stat status;
+    if (indexDescribes(ctx, fileno(in))) {
+        return 0;
+    }
+    releasePlan(ctx); // left by a tool over another image
+    if (fstat(fileno(in), &status) != 0) {
+        memset(&status, 0, sizeof(struct stat));
+    }
 
-    blockSize = (size_t) superBlock->size;
-    buffer = malloc(blockSize);
+    if (loadSuperBlock(ctx, in) != 0) {
+        fprintf(stderr, "Super block describes regions out of order or past the end of the image\n");
+        ctx->error |= ERROR_DATA_BLOCK_LOST;
+        releasePlan(ctx);
+        return -1;
+    }
+    loadInodes(ctx, in);
+    indexInodes(ctx);
+    ctx->index.device = status.st_dev;
+    ctx->index.file = status.st_ino;
+    return 0;
+}
 
-    // calculate initial address of three regions
-    inodeInitial = 1024 + superBlock->inode_offset * blockSize;
-    dataInitial = 1024 + superBlock->data_offset * blockSize;
-    swapInitial = 1024 + superBlock->swap_offset * blockSize;
+#define INDEX_GAP 8 // unused blocks between two indirect blocks read through rather than split into two reads
+
+// an indirect block indexBlocks has to read
+typedef struct {
+    int blk;
+    int depth;
+    size_t data;     /* data blocks of the file below this block */
+    size_t count;    /* live pointers of this block */
+    size_t pointers; /* first live pointer of this block in pointer pool */
+    size_t child;    /* first request for a child of this block, for a depth above 1 */
+} indexRequest;
+
+// requests and what they read so far, see indexBlocks
+typedef struct {
+    indexRequest *requests;
+    size_t count;
+    size_t capacity;
+    int *pool;           /* live pointers of every request, -1 until read */
+    size_t poolCount;
+    size_t poolCapacity;
+} indexBuilder;
 
-    //dumpInodeFreeList(inFile);
-    //dumpDataFreeList(inFile);
+/**
+ * Ask for an indirect block at given depth holding data blocks of a file below it, its live pointers
+ * are taken the way planTree does: children while data blocks remain, each one holding a full tree at most
+ * @return Index of the request
+ */
+size_t requestBlock(defragContext *ctx, indexBuilder *builder, int blk, int depth, size_t data) {
+    size_t span = treeSpan(ctx, depth - 1);
+    if (builder->count == builder->capacity) {
+        builder->capacity = builder->capacity > 0 ? builder->capacity * 2 : 64;
+        builder->requests = realloc(builder->requests, sizeof(indexRequest) * builder->capacity);
+    }
+    indexRequest *request = &builder->requests[builder->count];
+    request->blk = blk;
+    request->depth = depth;
+    request->data = data;
+    request->count = (data + span - 1) / span;
+    request->pointers = builder->poolCount;
+    request->child = 0;
+    builder->poolCount += request->count;
+    if (builder->poolCount > builder->poolCapacity) {
+        builder->poolCapacity = builder->poolCount * 2;
+        builder->pool = realloc(builder->pool, sizeof(int) * builder->poolCapacity);
+    }
+    return builder->count++;
+}
 
-    // hold place for superblock and inodes
-    copyInodes(inFile, outFile);
+/**
+ * Ask for the indirect blocks an inode roots, in the order of its pointer fields
+ * @param dataCount Data blocks of the file
+ */
+void requestRoots(defragContext *ctx, indexBuilder *builder, inode *inode, size_t dataCount) {
+    int *roots[N_ROOTS];
+    int depths[N_ROOTS];
+    int i, n = inodeRoots(inode, roots, depths);
+    for (i = 0; i < n && dataCount > 0; i++) {
+        size_t data = depths[i] == 0 ? 1 : treeSpan(ctx, depths[i]);
+        data = data < dataCount ? data : dataCount;
+        if (depths[i] > 0) {
+            requestBlock(ctx, builder, *roots[i], depths[i], data);
+        }
+        dataCount -= data;
+    }
+}
 
-    // read used inode and write data blocks
-    size_t inodeCount = (superBlock->data_offset - superBlock->inode_offset) * blockSize / inodeSize;
-    dataBlockIndex = 0;
-    writeAllFiles(inFile, outFile, inodeCount);
+/**
+ * Store live pointers of a request read from content, NULL if the block cannot be read, then ask for its children
+ */
+void fillRequest(defragContext *ctx, indexBuilder *builder, size_t r, const int *content) {
+    size_t j;
+    indexRequest *request = &builder->requests[r];
+    for (j = 0; j < request->count; j++) {
+        builder->pool[request->pointers + j] = content != NULL ? content[j] : -1;
+    }
+    if (request->depth == 1) {
+        return;
+    }
 
-    writeFreeDataBlock(inFile, outFile);
-    dataRegionMender(inFile, outFile);
+    size_t span = treeSpan(ctx, request->depth - 1), data = request->data;
+    request->child = builder->count;
+    for (j = 0; j < builder->requests[r].count; j++) { // requests move as children are added
+        size_t child = data < span ? data : span;
+        requestBlock(ctx, builder, builder->pool[builder->requests[r].pointers + j], builder->requests[r].depth - 1,
+                     child);
+        data -= child;
+    }
+}
 
-    fseek(outFile, 512, SEEK_SET);
-    fwrite(superBlock, 1, DEFAULT_BLOCK_SIZE, outFile);
+int compareRequest(const void *a, const void *b, void *arg) {
+    indexBuilder *builder = arg;
+    int x = builder->requests[*(const size_t *) a].blk, y = builder->requests[*(const size_t *) b].blk;
+    return x != y ? (x > y ? 1 : -1) : 0;
+}
 
-    writeSwapRegion(inFile, outFile);
+/**
+ * Read every requested indirect block of a depth in one ascending sweep, blocks close to each other
+ * are fetched by the same read, a block out of data region or past the end of image reads as -1 pointers
+ */
+void sweepDepth(defragContext *ctx, indexBuilder *builder, int fd, int depth) {
+    size_t a, b, k, m = 0;
+    int dataRegion = ctx->superBlock->swap_offset - ctx->superBlock->data_offset;
+    int window = COPY_WINDOW_BYTES / ctx->blockSize > 0 ? COPY_WINDOW_BYTES / ctx->blockSize : 1;
+    size_t *order = malloc(sizeof(size_t) * (builder->count + 1));
+    for (k = 0; k < builder->count; k++) {
+        if (builder->requests[k].depth == depth) {
+            order[m++] = k;
+        }
+    }
+    qsort_r(order, m, sizeof(size_t), compareRequest, builder);
+
+    char *buffer = allocBlocks(window, ctx->blockSize);
+    for (a = 0; a < m; a = b) {
+        int first = builder->requests[order[a]].blk, last = first;
+        if (first < 0 || first >= dataRegion) {
+            fillRequest(ctx, builder, order[a], NULL);
+            b = a + 1;
+            continue;
+        }
+        for (b = a + 1; b < m; b++) { // out of range ones sort at both ends, never between
+            int blk = builder->requests[order[b]].blk;
+            if (blk >= dataRegion || blk - last > INDEX_GAP + 1 || blk - first >= window) {
+                break;
+            }
+            last = blk;
+        }
 
+        size_t length = (size_t) (last - first + 1) * ctx->blockSize;
+        ssize_t got = pread(fd, buffer, length, blockOffset(ctx, first));
+        if (got > 0) {
+            countIo(ctx, 0, blockOffset(ctx, first), (size_t) got, IO_REQUEST);
+        }
+        for (k = a; k < b; k++) {
+            size_t offset = (size_t) (builder->requests[order[k]].blk - first) * ctx->blockSize;
+            fillRequest(ctx, builder, order[k],
+                        got >= 0 && offset + ctx->blockSize <= (size_t) got ? (int *) (buffer + offset) : NULL);
+        }
+    }
     free(buffer);
-    free(superBlock);
+    free(order);
+}
+
+/**
+ * Append a request and the tree below it to blocks of the index, in the order planTree walks them
+ */
+void flattenRequest(indexBuilder *builder, size_t r, int *blocks, size_t *next) {
+    size_t j;
+    indexRequest *request = &builder->requests[r];
+    blocks[(*next)++] = request->blk;
+    for (j = 0; j < request->count; j++) {
+        if (request->depth == 1) {
+            blocks[(*next)++] = builder->pool[request->pointers + j];
+        } else {
+            flattenRequest(builder, request->child + j, blocks, next);
+        }
+    }
+}
+
+/**
+ * Complete metadata index with every block of every live file, indirect ones included
+ * Indirect blocks are read one depth at a time, from I3 blocks down to I1 blocks, each depth in one ascending
+ * sweep, so loading metadata is a few sequential passes rather than a pread per indirect block
+ * Blocks of a file are listed in the order planTree takes them, as many as fileFootprint counts
+ * Note that loadIndex must be called first
+ * @param in The input file pointer
+ */
+void indexBlocks(defragContext *ctx, FILE *in) {
+    metaIndex *index = &ctx->index;
+    indexBuilder builder;
+    size_t i, total = 0;
+    int depth;
+    if (index->blocks != NULL) {
+        return;
+    }
+    memset(&builder, 0, sizeof(indexBuilder));
+    fflush(in);
+
+    size_t *firstRequest = malloc(sizeof(size_t) * (index->inodeCount + 1));
+    index->firstBlock = malloc(sizeof(size_t) * (index->inodeCount + 1));
+    for (i = 0; i < index->inodeCount; i++) {
+        firstRequest[i] = builder.count;
+        index->firstBlock[i] = total;
+        if (index->nlink[i] > 0) {
+            total += fileFootprint(ctx, index->size[i]);
+            requestRoots(ctx, &builder, inodeAt(ctx, i), dataBlockCount(ctx, index->size[i]));
+        }
+    }
+    index->firstBlock[index->inodeCount] = total;
+    for (depth = MAX_DEPTH; depth > 0; depth--) {
+        sweepDepth(ctx, &builder, fileno(in), depth);
+    }
+
+    index->blocks = malloc(sizeof(int) * (total + 1));
+    for (i = 0; i < index->inodeCount; i++) {
+        if (index->nlink[i] <= 0) {
+            continue;
+        }
+        int *roots[N_ROOTS];
+        int depths[N_ROOTS];
+        int k, n = inodeRoots(inodeAt(ctx, i), roots, depths);
+        size_t next = index->firstBlock[i], r = firstRequest[i];
+        size_t dataCount = dataBlockCount(ctx, index->size[i]);
+        for (k = 0; k < n && dataCount > 0; k++) {
+            if (depths[k] == 0) {
+                index->blocks[next++] = *roots[k];
+                dataCount--;
+            } else {
+                dataCount -= builder.requests[r].data;
+                flattenRequest(&builder, r++, index->blocks, &next);
+            }
+        }
+    }
+
+    free(firstRequest);
+    free(builder.requests);
+    free(builder.pool);
+}
+
+/**
+ * Order files are laid out in under layout option, ties are broken by inode index
+ */
+int compareLayout(const void *a, const void *b, void *arg) {
+    defragContext *ctx = arg;
+    int i = *(const int *) a, j = *(const int *) b;
+    inode *x = inodeAt(ctx, i), *y = inodeAt(ctx, j);
+    long key = 0;
+    switch (ctx->options.layout) {
+        case LAYOUT_HOT: // most recently used first
+            key = (long) (y->atime > y->mtime ? y->atime : y->mtime) - (x->atime > x->mtime ? x->atime : x->mtime);
+            break;
+        case LAYOUT_SMALL:
+            key = (long) x->size - y->size;
+            break;
+        case LAYOUT_OWNER:
+            key = x->uid != y->uid ? (long) x->uid - y->uid : (long) x->gid - y->gid;
+            break;
+    }
+    return key != 0 ? (key > 0 ? 1 : -1) : i - j;
+}
+
+/**
+ * Inode indexes in the order files are laid out, allocated by malloc
+ */
+int *layoutOrder(defragContext *ctx, size_t inodeCount) {
+    size_t i;
+    int *order = malloc(sizeof(int) * (inodeCount + 1));
+    for (i = 0; i < inodeCount; i++) {
+        order[i] = (int) i;
+    }
+    if (ctx->options.layout != LAYOUT_INODE) {
+        qsort_r(order, inodeCount, sizeof(int), compareLayout, ctx);
+    }
+    return order;
+}
+
+/**
+ * This function assign every live file a fixed range of output blocks,
+ * by prefix-summing file footprints in layout order, see layoutOrder
+ * @return Total number of blocks used by all files, i.e. the first free block
+ */
+int layoutFiles(defragContext *ctx, size_t inodeCount) {
+    int k, next = 0;
+    int *order = layoutOrder(ctx, inodeCount);
+    ctx->fileStart = malloc(sizeof(int) * inodeCount);
+    for (k = 0; k < inodeCount; k++) {
+        int i = order[k];
+        ctx->fileStart[i] = next;
+        if (ctx->index.nlink[i] > 0) {
+            next += fileFootprint(ctx, ctx->index.size[i]);
+        }
+    }
+    free(order);
+    return next;
+}
+
+/**
+ * This function claim the next output location of a file for block blk of input image,
+ * or its current location if the file is planned in identity mode
+ * An indirect block is claimed from the indirect section of the file when indirectFirst option is set
+ * A block out of data region, or referenced twice, cannot be relocated and is reported as lost
+ * Claims are atomic, so files can be planned concurrently
+ * @param blk Index of the block in input image
+ * @param indirect Non-zero for an indirect block
+ * @param cursor Output position of this file, the claimed block is recorded into it
+ * @return The new index of this block in output image
+ */
+int planBlock(defragContext *ctx, int blk, int indirect, planCursor *cursor) {
+    int slot = indirect && cursor->nextIndirect >= 0 ? cursor->nextIndirect++ : cursor->next++;
+    int newIndex = cursor->mode == PLAN_SEQUENTIAL ? slot : blk;
+    size_t position = (size_t) (slot - cursor->start); // sources are kept in output order
+    if (cursor->sources != NULL) {
+        cursor->sources[position] = blk;
+        cursor->count = position + 1 > cursor->count ? position + 1 : cursor->count;
+    }
+    if (cursor->mode == PLAN_SURVEY) {
+        if ((blk < 0 || blk >= ctx->dataRegion) && cursor->sources != NULL) {
+            cursor->sources[position] = -1;
+        }
+        return newIndex;
+    }
+    if (newIndex >= 0 && newIndex < ctx->dataRegion) { // taken even if the block is lost, the inode points there
+        ctx->usedMap[newIndex] = 1;
+    }
+    if (blk < 0 || blk >= ctx->dataRegion || !__sync_bool_compare_and_swap(&ctx->relocation[blk], -1, newIndex)) {
+        __sync_fetch_and_or(&ctx->error, ERROR_DATA_BLOCK_LOST); // files may be planned concurrently
+        if (cursor->sources != NULL) {
+            cursor->sources[position] = -1;
+        }
+    }
+    return newIndex;
+}
+
+/**
+ * This function plan a block and, for an indirect block, the whole tree below it, depth first
+ * Every indirect block is placed right before the blocks it indexes, unless indirectFirst option is set
+ * Blocks are taken from the list of the file in metadata index, which holds them in this very order,
+ * so nothing is read here
+ * Also decrease dataCount, which count for remaining data blocks for this file
+ * @param blocks Blocks of the file in metadata index, next is the position of this block in it, advanced here
+ * @param depth 0 for a data block, 1 for I1, 2 for I2 and 3 for I3 block
+ * @return The new index of this block
+ */
+int planTree(defragContext *ctx, const int *blocks, size_t *next, int depth, size_t *dataCount, planCursor *cursor) {
+    int blk = blocks[(*next)++];
+    if (depth == 0) {
+        (*dataCount)--;
+        return planBlock(ctx, blk, 0, cursor);
+    }
+
+    int i;
+    int newIndex = planBlock(ctx, blk, 1, cursor);
+    for (i = 0; i < ctx->kernels.fanout && *dataCount > 0; i++) {
+        planTree(ctx, blocks, next, depth - 1, dataCount, cursor);
+    }
+    if (blk >= 0 && blk < ctx->dataRegion) {
+        ctx->pointerCount[blk] = i;
+    }
+    return newIndex;
+}
+
+/**
+ * This function plan all blocks of a file in their final order, starting from cursor
+ * With indirectFirst option, all indirect blocks of the file come first and its data blocks follow
+ * Pointer fields in input inode are updated to the new locations
+ * @param file Index of the inode, its blocks must be in metadata index, see indexBlocks
+ */
+void planSingleFile(defragContext *ctx, size_t file, planCursor *cursor) {
+    int i;
+    inode *inode = inodeAt(ctx, file);
+    size_t next = ctx->index.firstBlock[file];
+    size_t dataCount = dataBlockCount(ctx, ctx->index.size[file]);
+    cursor->nextIndirect = -1;
+    if (ctx->options.indirectFirst) {
+        cursor->nextIndirect = cursor->next;
+        cursor->next += (int) indirectBlockCount(ctx, inode->size);
+    }
+
+    int *roots[N_ROOTS];
+    int depths[N_ROOTS];
+    int n = inodeRoots(inode, roots, depths);
+    for (i = 0; i < n && dataCount > 0; i++) {
+        *roots[i] = planTree(ctx, ctx->index.blocks, &next, depths[i], &dataCount, cursor);
+    }
+
+    if (dataCount > 0) {
+        __sync_fetch_and_or(&ctx->error, ERROR_DATA_BLOCK_LOST); // files may be planned concurrently
+        perror("Not all blocks written!");
+    }
+}
+
+/**
+ * Prepare a cursor to plan files of current image
+ * @param mode One of PLAN_*
+ * @param record Non-zero to record sources of every file, then sources can hold a file of capacity blocks
+ */
+void initCursor(defragContext *ctx, planCursor *cursor, int mode, int record) {
+    memset(cursor, 0, sizeof(planCursor));
+    cursor->mode = mode;
+    if (record) {
+        cursor->capacity = 1;
+        cursor->sources = malloc(sizeof(int) * cursor->capacity);
+    }
+}
+
+/**
+ * Make sure a file of given footprint can be recorded, and rewind the cursor to start
+ * Sources of a file which turns out shorter than its footprint are left as lost, i.e. -1
+ */
+void rewindCursor(defragContext *ctx, planCursor *cursor, int start, size_t footprint) {
+    if (cursor->sources != NULL && footprint > cursor->capacity) {
+        cursor->capacity = footprint;
+        cursor->sources = realloc(cursor->sources, sizeof(int) * cursor->capacity);
+    }
+    if (cursor->sources != NULL) {
+        memset(cursor->sources, -1, sizeof(int) * footprint);
+    }
+    cursor->start = start;
+    cursor->next = start;
+    cursor->count = 0;
+}
+
+void releaseCursor(defragContext *ctx, planCursor *cursor) {
+    free(cursor->sources);
+}
+
+/**
+ * Allocate an empty relocation table for data region
+ */
+void allocatePlan(defragContext *ctx) {
+    ctx->dataRegion = ctx->superBlock->swap_offset - ctx->superBlock->data_offset;
+    ctx->relocation = malloc(sizeof(int) * ctx->dataRegion);
+    memset(ctx->relocation, -1, sizeof(int) * ctx->dataRegion);
+    ctx->pointerCount = calloc(ctx->dataRegion, sizeof(unsigned short));
+    ctx->usedMap = calloc(ctx->dataRegion, 1);
+}
+
+/**
+ * First pass of defragmenter: walk every live inode and its indirect tree,
+ * and build the complete old -> new relocation table, nothing is written
+ * Every file is planned from the start of its range given by layoutFiles
+ */
+void planAllFiles(defragContext *ctx, size_t inodeCount) {
+    int i;
+    planCursor cursor;
+    initCursor(ctx, &cursor, PLAN_SEQUENTIAL, 0);
+    allocatePlan(ctx);
+
+    ctx->dataBlockIndex = layoutFiles(ctx, inodeCount);
+    for (i = 0; i < inodeCount; i++) {
+        if (ctx->index.nlink[i] > 0) {
+            rewindCursor(ctx, &cursor, ctx->fileStart[i], 0);
+            planSingleFile(ctx, i, &cursor);
+        }
+    }
+    releaseCursor(ctx, &cursor);
+}
+
+/**
+ * This function collect free extents (runs of blocks no file occupies) from usedMap, in ascending order
+ * @param starts Output, first block of every extent, allocated by malloc
+ * @param lengths Output, length of every extent, allocated by malloc
+ * @return Number of extents
+ */
+size_t collectExtents(defragContext *ctx, int **starts, int **lengths) {
+    size_t n = 0, capacity = 16;
+    int i, j;
+    *starts = malloc(sizeof(int) * capacity);
+    *lengths = malloc(sizeof(int) * capacity);
+    for (i = 0; i < ctx->dataRegion; i = j) {
+        if (ctx->usedMap[i]) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < ctx->dataRegion && !ctx->usedMap[j]; j++);
+        if (n == capacity) {
+            capacity *= 2;
+            *starts = realloc(*starts, sizeof(int) * capacity);
+            *lengths = realloc(*lengths, sizeof(int) * capacity);
+        }
+        (*starts)[n] = i;
+        (*lengths)[n++] = j - i;
+    }
+    return n;
+}
+
+/**
+ * Incremental layout: a file whose blocks already sit in layout order on consecutive blocks keeps its place,
+ * a fragmented file is moved into the first free gap large enough to hold it,
+ * and a fragmented file which fits nowhere is left untouched
+ * Gaps are free blocks at first, blocks released by moved files join them when no gap is large enough
+ * Fills fileStart, -1 meaning the file keeps its current blocks, and usedMap
+ */
+void layoutIncremental(defragContext *ctx, size_t inodeCount) {
+    size_t i, k;
+    planCursor cursor;
+    initCursor(ctx, &cursor, PLAN_SURVEY, 1);
+    int **oldBlocks = calloc(inodeCount, sizeof(int *));
+    size_t *oldCount = calloc(inodeCount, sizeof(size_t));
+    ctx->fileStart = malloc(sizeof(int) * inodeCount);
+
+    // survey where every file is, and keep contiguous ones in place
+    for (i = 0; i < inodeCount; i++) {
+        ctx->fileStart[i] = -1;
+        if (ctx->index.nlink[i] <= 0) {
+            continue;
+        }
+        rewindCursor(ctx, &cursor, 0, fileFootprint(ctx, ctx->index.size[i]));
+        planSingleFile(ctx, i, &cursor);
+
+        int contiguous = cursor.count > 0 && cursor.count == fileFootprint(ctx, ctx->index.size[i]);
+        for (k = 0; k < cursor.count && contiguous; k++) {
+            contiguous = cursor.sources[k] >= 0 && cursor.sources[k] == cursor.sources[0] + (int) k
+                         && !ctx->usedMap[cursor.sources[k]];
+        }
+        for (k = 0; k < cursor.count; k++) {
+            if (cursor.sources[k] >= 0) {
+                ctx->usedMap[cursor.sources[k]] = 1;
+            }
+        }
+        if (contiguous) {
+            ctx->fileStart[i] = cursor.sources[0];
+        } else {
+            oldBlocks[i] = malloc(sizeof(int) * (cursor.count + 1));
+            memcpy(oldBlocks[i], cursor.sources, sizeof(int) * cursor.count);
+            oldCount[i] = cursor.count;
+        }
+    }
+    releaseCursor(ctx, &cursor);
+
+    // first fit for fragmented files
+    int *starts, *lengths;
+    size_t extentCount = collectExtents(ctx, &starts, &lengths);
+    int released = 0; // blocks released since extents were collected
+    int *order = layoutOrder(ctx, inodeCount);
+    size_t n;
+    for (n = 0; n < inodeCount; n++) {
+        i = order[n];
+        if (oldBlocks[i] == NULL) {
+            continue;
+        }
+        int footprint = (int) fileFootprint(ctx, ctx->index.size[i]);
+        size_t e;
+        for (e = 0; e < extentCount && lengths[e] < footprint; e++);
+        if (e == extentCount && released > 0) {
+            free(starts);
+            free(lengths);
+            extentCount = collectExtents(ctx, &starts, &lengths);
+            released = 0;
+            for (e = 0; e < extentCount && lengths[e] < footprint; e++);
+        }
+        if (e < extentCount) {
+            ctx->fileStart[i] = starts[e];
+            memset(ctx->usedMap + starts[e], 1, footprint);
+            starts[e] += footprint;
+            lengths[e] -= footprint;
+            for (k = 0; k < oldCount[i]; k++) {
+                if (oldBlocks[i][k] >= 0) {
+                    ctx->usedMap[oldBlocks[i][k]] = 0;
+                }
+            }
+            released += (int) oldCount[i];
+        }
+        free(oldBlocks[i]);
+    }
+
+    free(order);
+    free(starts);
+    free(lengths);
+    free(oldBlocks);
+    free(oldCount);
+}
+
+/**
+ * First pass of incremental defragmenter, same as planAllFiles but with layoutIncremental,
+ * files which stay where they are are planned in identity mode
+ * dataBlockIndex is set past the last used block
+ */
+void planIncremental(defragContext *ctx, size_t inodeCount) {
+    int i;
+    planCursor cursor;
+    initCursor(ctx, &cursor, PLAN_SEQUENTIAL, 0);
+    allocatePlan(ctx);
+    layoutIncremental(ctx, inodeCount);
+
+    // usedMap is rebuilt from what is actually planned
+    memset(ctx->usedMap, 0, ctx->dataRegion);
+    for (i = 0; i < inodeCount; i++) {
+        if (ctx->index.nlink[i] > 0) {
+            cursor.mode = ctx->fileStart[i] >= 0 ? PLAN_SEQUENTIAL : PLAN_IDENTITY;
+            rewindCursor(ctx, &cursor, ctx->fileStart[i], 0);
+            planSingleFile(ctx, i, &cursor);
+        }
+    }
+    releaseCursor(ctx, &cursor);
+
+    for (ctx->dataBlockIndex = ctx->dataRegion; ctx->dataBlockIndex > 0 &&
+            !ctx->usedMap[ctx->dataBlockIndex - 1]; ctx->dataBlockIndex--);
+}
+
+/**
+ * Head of the data free list writeFreeList rebuilds: the first block no file occupies, -1 if there is none
+ */
+int freeListHead(defragContext *ctx) {
+    int i;
+    for (i = 0; i < ctx->dataRegion && ctx->usedMap[i]; i++);
+    return i < ctx->dataRegion ? i : -1;
+}
+
+/**
+ * This function rebuild the data free list from usedMap: every block no file occupies, linked in ascending order
+ * Free runs are emitted in one ascending pass and nothing is read from input, stale payloads are not carried over
+ * A free block is zero-filled except for its next pointer; a mapped output is zero already, so only pointers are stored
+ * @param outFile The output file pointer
+ */
+void writeFreeList(defragContext *ctx, FILE *outFile) {
+    int i, j, k, n, next;
+    int window = COPY_WINDOW_BYTES / ctx->blockSize > 0 ? COPY_WINDOW_BYTES / ctx->blockSize : 1;
+    char *run = ctx->outMap == NULL ? calloc(window, ctx->blockSize) : NULL;
+
+    ctx->superBlock->free_iblock = freeListHead(ctx);
+
+    for (i = ctx->superBlock->free_iblock >= 0 ? ctx->superBlock->free_iblock : ctx->dataRegion;
+         i < ctx->dataRegion; i = next) {
+        for (j = i + 1; j < ctx->dataRegion && !ctx->usedMap[j]; j++);
+        for (next = j; next < ctx->dataRegion && ctx->usedMap[next]; next++);
+
+        // blocks i..j-1 are free, the last one links to the head of next run
+        for (k = i; k < j; k += n) {
+            n = j - k < window ? j - k : window;
+            int b, pointer;
+            for (b = 0; b < n; b++) {
+                pointer = k + b + 1 < j ? k + b + 1 : (next < ctx->dataRegion ? next : -1);
+                if (run == NULL) {
+                    writeAt(ctx, outFile, blockOffset(ctx, k + b), &pointer, sizeof(int));
+                } else {
+                    memcpy(run + (size_t) b * ctx->blockSize, &pointer, sizeof(int));
+                }
+            }
+            if (run != NULL) {
+                writeAt(ctx, outFile, blockOffset(ctx, k), run, (size_t) n * ctx->blockSize);
+            }
+        }
+    }
+    free(run);
+}
+
+/**
+ * This function rewrite live pointers of an indirect block from old to new indexes
+ * @param blk Index of the block in input image
+ * @param content Content of this block, updated in place
+ */
+void translatePointers(defragContext *ctx, int blk, int *content) {
+    int i;
+    for (i = 0; i < ctx->pointerCount[blk]; i++) {
+        if (content[i] >= 0 && content[i] < ctx->dataRegion && ctx->relocation[content[i]] >= 0) {
+            content[i] = ctx->relocation[content[i]];
+        }
+    }
+}
+
+/**
+ * Release everything allocated for the current image by loadIndex, indexBlocks and planAllFiles
+ */
+void releasePlan(defragContext *ctx) {
+    free(ctx->copyBuffer);
+    ctx->copyBuffer = NULL;
+    free(ctx->relocation);
+    ctx->relocation = NULL;
+    free(ctx->pointerCount);
+    ctx->pointerCount = NULL;
+    free(ctx->inodeTable);
+    ctx->inodeTable = NULL;
+    free(ctx->fileStart);
+    ctx->fileStart = NULL;
+    free(ctx->usedMap);
+    ctx->usedMap = NULL;
+    free(ctx->superBlock);
+    ctx->superBlock = NULL;
+    free(ctx->index.size);
+    free(ctx->index.nlink);
+    free(ctx->index.firstBlock);
+    free(ctx->index.blocks);
+    memset(&ctx->index, 0, sizeof(metaIndex));
+}
+
+int compareIndex(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+int compareDestination(const void *a, const void *b, void *arg) {
+    defragContext *ctx = arg;
+    return ctx->relocation[*(const int *) a] - ctx->relocation[*(const int *) b];
+}
+
+/**
+ * Make everything written to the file so far durable
+ */
+void syncFile(FILE *file) {
+    fflush(file);
+    fsync(fileno(file));
+}
+
+/**
+ * Fill the header of relocation map for current image and options, from input super block and inode region
+ * Must be called before planning, which rewrites inode region in memory
+ */
+void describeMap(defragContext *ctx) {
+    memset(&ctx->map, 0, sizeof(relocationMap));
+    memcpy(ctx->map.magic, MAP_MAGIC, sizeof(ctx->map.magic));
+    ctx->map.super = *ctx->superBlock;
+    ctx->map.inodeCrc = crc32c(0, ctx->inodeTable, ctx->inodeRegionSize);
+    ctx->map.layout = ctx->options.layout;
+    ctx->map.indirectFirst = ctx->options.indirectFirst;
+    ctx->map.incremental = ctx->options.incremental;
+}
+
+/**
+ * Read or write a part of relocation map, with plain pread/pwrite: image maps and sparse writes never apply to it
+ * @return 0 on success, -1 on failure
+ */
+int mapIo(defragContext *ctx, int write, off_t offset, void *buffer, size_t length) {
+    size_t done = 0;
+    ssize_t n = 1;
+    while (done < length && n > 0) {
+        n = write ? pwrite(fileno(ctx->mapFile), (char *) buffer + done, length - done, offset + done) :
+                pread(fileno(ctx->mapFile), (char *) buffer + done, length - done, offset + done);
+        done += n > 0 ? (size_t) n : 0;
+    }
+    return done == length ? 0 : -1;
+}
+
+/**
+ * Transfer the plan between context and relocation map, every part following the header, see relocationMap
+ * @return 0 on success, -1 on failure
+ */
+int mapPlan(defragContext *ctx, int write) {
+    off_t offset = sizeof(relocationMap);
+    int failed = mapIo(ctx, write, offset, ctx->relocation, sizeof(int) * ctx->dataRegion);
+    offset += (off_t) sizeof(int) * ctx->dataRegion;
+    failed |= mapIo(ctx, write, offset, ctx->pointerCount, sizeof(unsigned short) * ctx->dataRegion);
+    offset += (off_t) sizeof(unsigned short) * ctx->dataRegion;
+    failed |= mapIo(ctx, write, offset, ctx->usedMap, ctx->dataRegion);
+    offset += ctx->dataRegion;
+    failed |= mapIo(ctx, write, offset, ctx->inodeTable, ctx->inodeRegionSize);
+    return failed;
+}
+
+void closeMap(defragContext *ctx) {
+    if (ctx->mapFile != NULL) {
+        fclose(ctx->mapFile);
+        ctx->mapFile = NULL;
+    }
+}
+
+/**
+ * Load the plan of an interrupted run from its relocation map, if there is one for this image and options
+ * @param mapName Path of relocation map, NULL if the run keeps none
+ * @return 0 if the plan is loaded and copy pass goes on from map.copied, -1 to plan from scratch
+ */
+int resumeMap(defragContext *ctx, const char *mapName) {
+    relocationMap saved;
+    if (mapName == NULL || (ctx->mapFile = fopen(mapName, "r+")) == NULL) {
+        return -1;
+    }
+    if (mapIo(ctx, 0, 0, &saved, sizeof(relocationMap)) != 0 ||
+        memcmp(&saved, &ctx->map, offsetof(relocationMap, dataRegion)) != 0 ||
+        saved.dataRegion != ctx->superBlock->swap_offset - ctx->superBlock->data_offset) {
+        closeMap(ctx); // stale map, of another image or options
+        return -1;
+    }
+
+    allocatePlan(ctx);
+    if (mapPlan(ctx, 0) != 0) {
+        closeMap(ctx);
+        releasePlan(ctx);
+        return -1;
+    }
+    ctx->dataBlockIndex = saved.dataBlockIndex;
+    ctx->map = saved;
+    ctx->nextCheckpoint = saved.copied;
+    printf("Resuming interrupted run from %s, %d of %d blocks swept\n", mapName, saved.copied, saved.dataRegion);
+    return 0;
+}
+
+/**
+ * Make output durable, then record in relocation map that input blocks below copied are in it
+ * A map which cannot be updated is dropped, the run goes on without checkpoints
+ */
+void saveCheckpoint(defragContext *ctx, FILE *outFile, int copied) {
+    if (ctx->mapFile == NULL) { // nothing to save, ever
+        ctx->nextCheckpoint = ctx->dataRegion;
+        return;
+    }
+    if (ctx->outMap != NULL) {
+        msync(ctx->outMap, ctx->mapLength, MS_SYNC);
+    }
+    syncFile(outFile);
+    ctx->map.copied = copied;
+    if (mapIo(ctx, 1, 0, &ctx->map, sizeof(relocationMap)) != 0) {
+        perror("Cannot update relocation map, this run cannot be resumed");
+        closeMap(ctx);
+        ctx->nextCheckpoint = ctx->dataRegion;
+        return;
+    }
+    syncFile(ctx->mapFile);
+    size_t interval = CHECKPOINT_BYTES / ctx->blockSize;
+    ctx->nextCheckpoint = copied + (int) (interval < (size_t) ctx->dataRegion ? interval : ctx->dataRegion);
+}
+
+/**
+ * Save the plan into a new relocation map, header last, so a map is never taken for complete before it is
+ * A run which cannot create its map goes on without it, it only cannot be resumed
+ * @param mapName Path of relocation map, NULL if the run keeps none
+ * @param copied Input blocks already copied, 0 unless the plan was made along with copy
+ */
+void createMap(defragContext *ctx, const char *mapName, FILE *outFile, int copied) {
+    if (mapName != NULL && ((ctx->mapFile = fopen(mapName, "w+")) == NULL || mapPlan(ctx, 1) != 0)) {
+        perror("Cannot create relocation map, this run cannot be resumed");
+        closeMap(ctx);
+    }
+    if (ctx->mapFile != NULL) {
+        ctx->map.dataRegion = ctx->dataRegion;
+        ctx->map.dataBlockIndex = ctx->dataBlockIndex;
+        syncFile(ctx->mapFile);
+    }
+    saveCheckpoint(ctx, outFile, copied);
+}
+
+/**
+ * Tell if block blk is copied unchanged to the same location, in sparse mode such spans are left to copyRange
+ */
+int isUntouched(defragContext *ctx, int blk) {
+    return ctx->options.sparse && ctx->relocation[blk] == blk && ctx->pointerCount[blk] == 0;
+}
+
+/**
+ * Second pass of defragmenter: copy every planned block to its new location
+ * Input is swept in ascending source order, a window of blocks is staged in memory,
+ * then written back sorted by destination, so consecutive destinations become a single write
+ * In mmap mode there is nothing to save on reads, runs go straight from map to map
+ */
+void copyPlannedBlocks(defragContext *ctx, FILE *inFile, FILE *outFile) {
+    int i, j, src;
+
+    if (ctx->inMap != NULL && ctx->outMap != NULL) {
+        for (src = ctx->map.copied; src < ctx->dataRegion; src = j) {
+            if (src >= ctx->nextCheckpoint) {
+                saveCheckpoint(ctx, outFile, src);
+            }
+            if (ctx->relocation[src] < 0) {
+                j = src + 1;
+                continue;
+            }
+            if (isUntouched(ctx, src)) {
+                for (j = src + 1; j < ctx->dataRegion && isUntouched(ctx, j); j++);
+                copyRange(ctx, inFile, outFile, blockOffset(ctx, src),
+                        blockOffset(ctx, src), (j - src) * ctx->blockSize);
+                continue;
+            }
+            for (j = src + 1; j < ctx->dataRegion && ctx->relocation[j] == ctx->relocation[j - 1] + 1; j++);
+            countIo(ctx, 0, blockOffset(ctx, src), (j - src) * ctx->blockSize, IO_MEMORY);
+            writeAt(ctx, outFile, blockOffset(ctx, ctx->relocation[src]),
+                    ctx->inMap + blockOffset(ctx, src), (j - src) * ctx->blockSize);
+            for (i = src; i < j; i++) {
+                if (ctx->pointerCount[i] > 0) {
+                    translatePointers(ctx, i, (int *) (ctx->outMap + blockOffset(ctx, ctx->relocation[i])));
+                }
+            }
+        }
+        return;
+    }
+
+    size_t window = COPY_WINDOW_BYTES / ctx->blockSize > 0 ? COPY_WINDOW_BYTES / ctx->blockSize : 1;
+    int *batch = malloc(sizeof(int) * window);
+    int *order = malloc(sizeof(int) * window);
+    char *staging = allocBlocks(window, ctx->blockSize);
+    char *scatter = allocBlocks(window, ctx->blockSize);
+
+    // with io_uring, all runs of a window are in flight together,
+    // and writes of a window overlap reads of the next one
+    blockRing ring;
+    int useRing = 0;
+    if (ctx->options.engine == ENGINE_URING) {
+        struct iovec buffers[2] = {{staging, window * ctx->blockSize}, {scatter, window * ctx->blockSize}};
+        useRing = ringOpen(&ring, URING_DEPTH, buffers, 2) == 0;
+        if (!useRing) {
+            perror("Cannot set up io_uring, fall back to stdio engine");
+        }
+        fflush(outFile);
+    }
+
+    src = ctx->map.copied;
+    while (src < ctx->dataRegion) {
+        if (src >= ctx->nextCheckpoint) { // every write so far must have landed
+            if (useRing && ringWait(&ring) > 0) {
+                ctx->error |= ERROR_DATA_BLOCK_LOST;
+            }
+            saveCheckpoint(ctx, outFile, src);
+        }
+
+        // collect the next window of planned blocks in source order
+        size_t n = 0;
+        for (; src < ctx->dataRegion && n < window; src++) {
+            if (isUntouched(ctx, src)) {
+                for (j = src + 1; j < ctx->dataRegion && isUntouched(ctx, j); j++);
+                copyRange(ctx, inFile, outFile, blockOffset(ctx, src),
+                        blockOffset(ctx, src), (j - src) * ctx->blockSize);
+                src = j - 1;
+            } else if (ctx->relocation[src] >= 0) {
+                batch[n++] = src;
+            }
+        }
+
+        // read them with one request per source run
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && batch[j] == batch[j - 1] + 1; j++);
+            if (useRing) {
+                ringQueue(&ring, 0, fileno(inFile), 0, staging + i * ctx->blockSize, (j - i) * ctx->blockSize,
+                          blockOffset(ctx, batch[i]));
+                countIo(ctx, 0, blockOffset(ctx, batch[i]), (j - i) * ctx->blockSize, IO_REQUEST);
+            } else {
+                readAt(ctx, inFile, blockOffset(ctx, batch[i]), staging + i * ctx->blockSize, (j - i) * ctx->blockSize);
+            }
+        }
+        if (useRing) { // reads of this window, and writes of last window from scatter, are all done
+            ringWait(&ring);
+        }
+        for (i = 0; i < n; i++) {
+            order[i] = batch[i];
+            if (ctx->pointerCount[batch[i]] > 0) {
+                translatePointers(ctx, batch[i], (int *) (staging + i * ctx->blockSize));
+            }
+        }
+
+        // reorder by destination, staging slot of a block is its position in (sorted) batch
+        qsort_r(order, n, sizeof(int), compareDestination, ctx);
+        for (i = 0; i < n; i++) {
+            int *slot = bsearch(order + i, batch, n, sizeof(int), compareIndex);
+            memcpy(scatter + i * ctx->blockSize, staging + (slot - batch) * ctx->blockSize, ctx->blockSize);
+        }
+
+        // write with one request per destination run
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && ctx->relocation[order[j]] == ctx->relocation[order[j - 1]] + 1; j++);
+            if (useRing) { // zero blocks are skipped in sparse mode, as storeAt does
+                size_t done, run, length = (j - i) * ctx->blockSize;
+                int zero = 0;
+                for (done = 0; done < length; done += run) {
+                    run = ctx->options.sparse ?
+                            sparseRun(ctx, scatter + i * ctx->blockSize + done, length - done, &zero) : length;
+                    if (!zero) {
+                        ringQueue(&ring, 1, fileno(outFile), 1, scatter + i * ctx->blockSize + done, run,
+                                  blockOffset(ctx, ctx->relocation[order[i]]) + done);
+                        countIo(ctx, 1, blockOffset(ctx, ctx->relocation[order[i]]) + done, run, IO_REQUEST);
+                    }
+                }
+            } else {
+                writeAt(ctx, outFile, blockOffset(ctx, ctx->relocation[order[i]]),
+                        scatter + i * ctx->blockSize, (j - i) * ctx->blockSize);
+            }
+        }
+    }
+
+    if (useRing) {
+        if (ringWait(&ring) > 0) {
+            ctx->error |= ERROR_DATA_BLOCK_LOST;
+        }
+        ringClose(&ring);
+    }
+    free(batch);
+    free(order);
+    free(staging);
+    free(scatter);
+}
+
+/**
+ * This function copy the blocks of one planned file into its output range
+ * The range is filled by windows: sources are fetched with one read per input run,
+ * indirect blocks are translated, then the whole window goes out in a single write
+ * @param start First output block of this file
+ * @param sources Input index of every block of this file in output order, -1 if lost
+ */
+void copySingleFile(defragContext *ctx, FILE *inFile, FILE *outFile, int start, int *sources, size_t count,
+        char *staging, size_t window) {
+    size_t base, k, j;
+    for (base = 0; base < count; base += window) {
+        size_t n = count - base < window ? count - base : window;
+        for (k = 0; k < n; k = j) {
+            int src = sources[base + k];
+            if (src < 0) {
+                memset(staging + k * ctx->blockSize, 0, ctx->blockSize);
+                j = k + 1;
+                continue;
+            }
+            for (j = k + 1; j < n && sources[base + j] == sources[base + j - 1] + 1; j++);
+            preadAt(ctx, inFile, blockOffset(ctx, src), staging + k * ctx->blockSize, (j - k) * ctx->blockSize);
+        }
+        for (k = 0; k < n; k++) {
+            int src = sources[base + k];
+            if (src >= 0 && ctx->pointerCount[src] > 0) {
+                translatePointers(ctx, src, (int *) (staging + k * ctx->blockSize));
+            }
+        }
+        pwriteAt(ctx, outFile, blockOffset(ctx, start + base), staging, n * ctx->blockSize);
+    }
+}
+
+typedef struct {
+    defragContext *ctx;
+    FILE *inFile;
+    FILE *outFile;
+    size_t inodeCount;
+} copyJob;
+
+/**
+ * Worker of copyFilesConcurrently, take files one at a time until none is left
+ * Each file is planned then copied on its own, its output range being fixed by layoutFiles
+ */
+void *copyWorker(void *arg) {
+    copyJob *job = arg;
+    defragContext *ctx = job->ctx;
+    size_t window = COPY_WINDOW_BYTES / ctx->blockSize > 0 ? COPY_WINDOW_BYTES / ctx->blockSize : 1;
+    char *staging = allocBlocks(window, ctx->blockSize);
+    planCursor cursor;
+    size_t i;
+    initCursor(ctx, &cursor, PLAN_SEQUENTIAL, 1);
+
+    while ((i = __sync_fetch_and_add(&ctx->nextInode, 1)) < job->inodeCount) {
+        if (ctx->index.nlink[i] <= 0) {
+            continue;
+        }
+        rewindCursor(ctx, &cursor, ctx->fileStart[i], fileFootprint(ctx, ctx->index.size[i]));
+        planSingleFile(ctx, i, &cursor);
+        copySingleFile(ctx, job->inFile, job->outFile, ctx->fileStart[i],
+                cursor.sources, cursor.count, staging, window);
+    }
+
+    releaseCursor(ctx, &cursor);
+    free(staging);
+    return NULL;
+}
+
+/**
+ * Plan and copy all files with threads workers of options, files are independent once layoutFiles
+ * has given each of them a fixed output range, so workers never wait for each other
+ * This replaces planAllFiles plus copyPlannedBlocks
+ */
+void copyFilesConcurrently(defragContext *ctx, FILE *inFile, FILE *outFile, size_t inodeCount) {
+    int i;
+    copyJob job = {ctx, inFile, outFile, inodeCount};
+    pthread_t *workers = malloc(sizeof(pthread_t) * ctx->options.threads);
+
+    allocatePlan(ctx);
+    ctx->dataBlockIndex = layoutFiles(ctx, inodeCount);
+    ctx->nextInode = 0;
+
+    fflush(outFile); // workers write with pwrite, nothing must be left in stdio buffer
+    int started = 0; // files are taken one at a time, so the workers that did start copy every one
+    for (i = 0; i < ctx->options.threads; i++) {
+        if (pthread_create(&workers[started], NULL, copyWorker, &job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Cannot start any copy worker\n");
+        ctx->error |= ERROR_DATA_BLOCK_LOST;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+/**
+ * Defragment the image in inFile into outFile
+ * The block transfer engine is chosen by engine option of the context
+ * With a relocation map, the plan is saved before copy pass starts and its progress is checkpointed in the map,
+ * so a run interrupted over the same input, output and map resumes where it stopped instead of starting over
+ * Threaded copy plans along with copying, its map is only saved once the copy is over
+ * @param mapName Path of relocation map, left in place after the run, NULL to run without
+ * @return 0 on success, non-zero if a fatal error (see ERROR_FATAL) is found, details are in contextError
+ */
+int defragmenter(defragContext *ctx, FILE *inFile, FILE *outFile, const char *mapName) {
+    char buffer[DEFAULT_BLOCK_SIZE];
+    ctx->error = ERROR_ALL_GREEN;
+    statMark(ctx);
+
+    if (loadIndex(ctx, inFile) != 0) {
+        return 1;
+    }
+    dumpSuperBlock(ctx, ctx->superBlock);
+    ctx->copyBuffer = allocBlocks(1, ctx->blockSize);
+
+    //dumpInodeFreeList(ctx);
+    //dumpDataFreeList(inFile);
+
+    describeMap(ctx);
+    int resumed = resumeMap(ctx, mapName) == 0;
+    if (!resumed && mapName != NULL && fflush(outFile) == 0 && ftruncate(fileno(outFile), 0) != 0) {
+        perror("Cannot empty output of an earlier run"); // stale blocks would show through holes of this one
+    }
+    if (!resumed) { // a resumed plan needs no indirect tree
+        indexBlocks(ctx, inFile);
+    }
+
+    if (ctx->options.engine == ENGINE_MMAP && mapImages(ctx, inFile, outFile) != 0) {
+        perror("Cannot map images, fall back to stdio engine");
+    }
+
+    // simply copy boot block
+    readAt(ctx, inFile, 0, buffer, DEFAULT_BLOCK_SIZE);
+    //dumpBootBlock(buffer);
+    writeAt(ctx, outFile, 0, buffer, DEFAULT_BLOCK_SIZE);
+    statPhase(ctx, PHASE_LOAD);
+
+    // plan every used block first, then copy them in source order,
+    // or plan and copy files in parallel, each one into its precomputed range
+    // incremental mode always takes the single pass, its layout depends on every file
+    size_t inodeCount = ctx->index.inodeCount;
+    if (resumed) {
+        statPhase(ctx, PHASE_PLAN);
+        copyPlannedBlocks(ctx, inFile, outFile);
+    } else if (ctx->options.incremental) {
+        planIncremental(ctx, inodeCount);
+        createMap(ctx, mapName, outFile, 0);
+        statPhase(ctx, PHASE_PLAN);
+        copyPlannedBlocks(ctx, inFile, outFile);
+    } else if (ctx->options.threads > 1) { // planning is part of copy
+        copyFilesConcurrently(ctx, inFile, outFile, inodeCount);
+        createMap(ctx, mapName, outFile, ctx->dataRegion);
+    } else {
+        planAllFiles(ctx, inodeCount);
+        createMap(ctx, mapName, outFile, 0);
+        statPhase(ctx, PHASE_PLAN);
+        copyPlannedBlocks(ctx, inFile, outFile);
+    }
+    if (ctx->map.copied < ctx->dataRegion) {
+        saveCheckpoint(ctx, outFile, ctx->dataRegion);
+    }
+    statPhase(ctx, PHASE_COPY);
+    if (ctx->options.compactInodes) {
+        compactInodeTable(ctx);
+    }
+    writeInodes(ctx, outFile);
+    statPhase(ctx, PHASE_INODES);
+    writeFreeList(ctx, outFile);
+    statPhase(ctx, PHASE_FREE_LIST);
+
+    writeAt(ctx, outFile, DEFAULT_BLOCK_SIZE, ctx->superBlock, DEFAULT_BLOCK_SIZE);
+
+    writeSwapRegion(ctx, inFile, outFile);
+    statPhase(ctx, PHASE_SWAP);
+
+    unmapImages(ctx);
+    if (fflush(outFile) != 0 || ferror(outFile)) { // buffered writes only fail when they are flushed
+        transferFailed(ctx);
+    }
+    statPhase(ctx, PHASE_SYNC);
+    closeMap(ctx);
+    releasePlan(ctx);
+
+    return (ctx->error & ERROR_FATAL) != ERROR_ALL_GREEN;
+}
+
+/*********************** From there, functions are parts of fragmentation analyzer ***********************/
+
+/**
+ * Count fragments of a file, a fragment is a run of blocks consecutive both in file order and on disk
+ * Blocks are taken in the order the defragmenter lays them out, indirect blocks included
+ * @param sources Input index of every block of the file in layout order, -1 if lost
+ */
+size_t countFragments(int *sources, size_t count) {
+    size_t i, fragments = count > 0;
+    for (i = 1; i < count; i++) {
+        if (sources[i] < 0 || sources[i] != sources[i - 1] + 1) {
+            fragments++;
+        }
+    }
+    return fragments;
+}
+
+/**
+ * Dry run of defragmenter: plan every file as usual, but only inodes and indirect blocks are read,
+ * and nothing is written, then report how fragmented the image is
+ * Estimated bytes to move counts blocks whose planned location differs from their current one
+ * @param inFile The input image
+ * @param perFile Non-zero to print one line per live file before the summary
+ * @return 0 on success, non-zero if planning found a fatal error
+ */
+int analyzer(defragContext *ctx, FILE *inFile, int perFile) {
+    size_t i, files = 0, blocks = 0, fragments = 0, moving = 0;
+    planCursor cursor;
+    ctx->error = ERROR_ALL_GREEN;
+
+    if (loadIndex(ctx, inFile) != 0) {
+        return 1;
+    }
+    indexBlocks(ctx, inFile);
+    initCursor(ctx, &cursor, PLAN_SEQUENTIAL, 1);
+    size_t inodeCount = ctx->index.inodeCount;
+    allocatePlan(ctx);
+    ctx->dataBlockIndex = layoutFiles(ctx, inodeCount);
+
+    if (perFile) {
+        printf("%8s %10s %10s %10s %10s\n", "inode", "blocks", "fragments", "avg run", "moving");
+    }
+    for (i = 0; i < inodeCount; i++) {
+        if (ctx->index.nlink[i] <= 0) {
+            continue;
+        }
+        rewindCursor(ctx, &cursor, ctx->fileStart[i], fileFootprint(ctx, ctx->index.size[i]));
+        planSingleFile(ctx, i, &cursor);
+
+        size_t k, fileFragments = countFragments(cursor.sources, cursor.count), fileMoving = 0;
+        for (k = 0; k < cursor.count; k++) {
+            fileMoving += cursor.sources[k] != ctx->fileStart[i] + (int) k;
+        }
+        if (perFile) {
+            printf("%8zu %10zu %10zu %10.1f %10zu\n", i, cursor.count, fileFragments,
+                   fileFragments > 0 ? (double) cursor.count / fileFragments : 0.0, fileMoving);
+        }
+        files++;
+        blocks += cursor.count;
+        fragments += fileFragments;
+        moving += fileMoving;
+    }
+
+    printf("Files:                 %zu\n", files);
+    printf("Used blocks:           %zu of %d\n", blocks, ctx->dataRegion);
+    printf("Fragments:             %zu\n", fragments);
+    printf("Average run length:    %.1f blocks\n", fragments > 0 ? (double) blocks / fragments : 0.0);
+    printf("Non-contiguous blocks: %.2f%%\n", blocks > 0 ? 100.0 * (fragments - files) / blocks : 0.0);
+    printf("Blocks to move:        %zu\n", moving);
+    printf("Bytes to move:         %zu\n", moving * ctx->blockSize);
+    if (ctx->error != ERROR_ALL_GREEN) {
+        printf("Errors:                %d\n", ctx->error);
+    }
+
+    releaseCursor(ctx, &cursor);
+    releasePlan(ctx);
+    return (ctx->error & ERROR_FATAL) != ERROR_ALL_GREEN;
+}
+
+/*********************** From there, functions are parts of in-place defragmenter ***********************/
+
+/**
+ * In-place mode permutes blocks inside the image itself, following the relocation plan
+ * Before anything is touched, a journal is written next to the image, holding:
+ *   header | new super block | new inode region | rewritten indirect blocks | free list updates
+ *   | move list | scratch | batch
+ * Data blocks are moved by batches of at most COPY_WINDOW_BYTES, every batch is first saved into
+ * the journal (redo log), then written into the image, so a crash at any point can be recovered
+ * by replaying the pending batch and carrying on with the remaining moves
+ */
+#define JOURNAL_MAGIC   "AFSJRNL1"
+#define JOURNAL_SCRATCH (-2) // pseudo block index, the scratch slot in journal used to break cycles
+
+typedef struct {
+    char magic[8];
+    int blockSize;
+    int dataRegion;
+    int indirectCount;   /* number of rewritten indirect blocks */
+    int freeUpdateCount; /* number of free blocks whose next pointer changes */
+    long moveCount;      /* number of data block moves */
+    long done;           /* moves already applied to image */
+    long pending;        /* moves of the batch saved in journal, 0 if none */
+} journalHeader;
+
+void locateJournalParts(defragContext *ctx, journalHeader *header) {
+    ctx->journalMetaOffset = DEFAULT_BLOCK_SIZE;
+    ctx->journalIndirectOffset = ctx->journalMetaOffset + DEFAULT_BLOCK_SIZE + ctx->inodeRegionSize;
+    ctx->journalFreeOffset = ctx->journalIndirectOffset + (off_t) header->indirectCount * (sizeof(int) + ctx->blockSize);
+    ctx->journalMoveOffset = ctx->journalFreeOffset + (off_t) header->freeUpdateCount * 2 * sizeof(int);
+    ctx->journalScratchOffset = ctx->journalMoveOffset + (off_t) header->moveCount * 2 * sizeof(int);
+    ctx->journalBatchOffset = ctx->journalScratchOffset + ctx->blockSize;
+}
+
+void saveJournalHeader(defragContext *ctx, FILE *journal, journalHeader *header) {
+    writeAt(ctx, journal, 0, header, sizeof(journalHeader));
+    syncFile(journal);
+}
+
+/**
+ * This function turn the relocation plan into an ordered list of data block moves (dst, src)
+ * Executed in order, every move reads a block which has not been overwritten yet:
+ * chains are started from a destination whose old content is not needed anymore,
+ * and cycles are broken by parking their first block in journal scratch slot
+ * Blocks already in place are not moved at all
+ * @param moveCount Output, number of moves
+ * @return The move list, allocated by malloc
+ */
+int *planMoves(defragContext *ctx, long *moveCount) {
+    int d, s, cur;
+    int *origin = malloc(sizeof(int) * ctx->dataRegion); // new index -> old index of data blocks
+    char *needed = calloc(ctx->dataRegion, 1);                // old content is still to be moved away
+    char *moved = calloc(ctx->dataRegion, 1);
+    int *moves = malloc(sizeof(int) * 4 * (ctx->dataRegion + 1)); // a cycle costs one more move than its length
+    long n = 0;
+
+    memset(origin, -1, sizeof(int) * ctx->dataRegion);
+    for (s = 0; s < ctx->dataRegion; s++) {
+        if (ctx->relocation[s] >= 0 && ctx->pointerCount[s] == 0 && ctx->relocation[s] != s) {
+            origin[ctx->relocation[s]] = s;
+            needed[s] = 1;
+        }
+    }
+
+    // chains: the head destination holds nothing worth keeping
+    for (d = 0; d < ctx->dataRegion; d++) {
+        if (origin[d] < 0 || moved[d] || needed[d]) {
+            continue;
+        }
+        for (cur = d; ; cur = s) {
+            s = origin[cur];
+            moves[n++] = cur;
+            moves[n++] = s;
+            moved[cur] = 1;
+            needed[s] = 0;
+            if (origin[s] < 0 || moved[s]) {
+                break;
+            }
+        }
+    }
+
+    // cycles: everything left is waiting for each other
+    for (d = 0; d < ctx->dataRegion; d++) {
+        if (origin[d] < 0 || moved[d]) {
+            continue;
+        }
+        moves[n++] = JOURNAL_SCRATCH;
+        moves[n++] = d;
+        for (cur = d; ; cur = s) {
+            s = origin[cur];
+            moves[n++] = cur;
+            moves[n++] = (s == d) ? JOURNAL_SCRATCH : s;
+            moved[cur] = 1;
+            if (s == d) {
+                break;
+            }
+        }
+    }
+
+    free(origin);
+    free(needed);
+    free(moved);
+    *moveCount = n / 2;
+    return moves;
+}
+
+/**
+ * This function compare the free list after defragmentation with the current one,
+ * and keep only the free blocks whose next pointer has to change
+ * The current list is walked reading a single pointer per block, free block content is never read
+ * @param count Output, number of updates
+ * @return Pairs of (block, next pointer), allocated by malloc
+ */
+int *planFreeListUpdates(defragContext *ctx, FILE *image, int *count) {
+    int i, blk, steps, next = -1;
+    int *oldNext = malloc(sizeof(int) * ctx->dataRegion);
+    int *updates = malloc(sizeof(int) * 2 * (ctx->dataRegion + 1));
+
+    for (i = 0; i < ctx->dataRegion; i++) {
+        oldNext[i] = -2; // not on current free list
+    }
+    for (blk = ctx->superBlock->free_iblock, steps = 0;
+            blk >= 0 && blk < ctx->dataRegion && steps < ctx->dataRegion; steps++) {
+        readAt(ctx, image, blockOffset(ctx, blk), &oldNext[blk], sizeof(int));
+        blk = oldNext[blk];
+    }
+
+    *count = 0;
+    for (i = ctx->dataRegion - 1; i >= 0; i--) {
+        if (ctx->usedMap[i]) {
+            continue;
+        }
+        if (oldNext[i] != next) {
+            updates[2 * *count] = i;
+            updates[2 * *count + 1] = next;
+            (*count)++;
+        }
+        next = i;
+    }
+    ctx->superBlock->free_iblock = next;
+
+    free(oldNext);
+    return updates;
+}
+
+/**
+ * This function write the whole journal for a fresh in-place run and make it durable
+ * Nothing in the image has been modified when it returns
+ */
+void writeJournal(defragContext *ctx, FILE *image, FILE *journal, journalHeader *header, int *moves, int *freeUpdates) {
+    int s;
+    int *buffer = malloc(ctx->blockSize);
+
+    locateJournalParts(ctx, header);
+    writeAt(ctx, journal, ctx->journalMetaOffset, ctx->superBlock, DEFAULT_BLOCK_SIZE);
+    writeAt(ctx, journal, ctx->journalMetaOffset + DEFAULT_BLOCK_SIZE, ctx->inodeTable, ctx->inodeRegionSize);
+
+    // indirect blocks are rewritten from journal at last, only those which move or change
+    off_t offset = ctx->journalIndirectOffset;
+    header->indirectCount = 0;
+    for (s = 0; s < ctx->dataRegion; s++) {
+        if (ctx->relocation[s] < 0 || ctx->pointerCount[s] == 0) {
+            continue;
+        }
+        readAt(ctx, image, blockOffset(ctx, s), buffer, ctx->blockSize);
+        int changed = ctx->relocation[s] != s;
+        int i;
+        for (i = 0; i < ctx->pointerCount[s]; i++) {
+            changed |= ctx->relocation[buffer[i]] != buffer[i];
+        }
+        if (!changed) {
+            continue;
+        }
+        translatePointers(ctx, s, buffer);
+        writeAt(ctx, journal, offset, &ctx->relocation[s], sizeof(int));
+        writeAt(ctx, journal, offset + sizeof(int), buffer, ctx->blockSize);
+        offset += sizeof(int) + ctx->blockSize;
+        header->indirectCount++;
+    }
+
+    locateJournalParts(ctx, header);
+    writeAt(ctx, journal, ctx->journalFreeOffset, freeUpdates, header->freeUpdateCount * 2 * sizeof(int));
+    writeAt(ctx, journal, ctx->journalMoveOffset, moves, header->moveCount * 2 * sizeof(int));
+    saveJournalHeader(ctx, journal, header);
+    free(buffer);
+}
+
+/**
+ * This function apply all remaining moves recorded in journal, batch by batch
+ * A batch saved but not known to be applied is replayed first
+ */
+void applyMoves(defragContext *ctx, FILE *image, FILE *journal, journalHeader *header, int *moves) {
+    long k;
+    size_t window = COPY_WINDOW_BYTES / ctx->blockSize > 0 ? COPY_WINDOW_BYTES / ctx->blockSize : 1;
+    char *batch = allocBlocks(window, ctx->blockSize);
+    char *scratch = allocBlocks(1, ctx->blockSize);
+
+    if (header->done > 0 || header->pending > 0) { // a fresh journal ends before scratch, nothing is parked there yet
+        readAt(ctx, journal, ctx->journalScratchOffset, scratch, ctx->blockSize);
+    }
+    while (header->done < header->moveCount || header->pending > 0) {
+        if (header->pending == 0) {
+            // read sources of the next batch, scratch written earlier in the same batch is taken from memory
+            header->pending = header->moveCount - header->done < window ? header->moveCount - header->done : window;
+            for (k = 0; k < header->pending; k++) {
+                int dst = moves[2 * (header->done + k)];
+                int src = moves[2 * (header->done + k) + 1];
+                if (src == JOURNAL_SCRATCH) {
+                    memcpy(batch + k * ctx->blockSize, scratch, ctx->blockSize);
+                } else {
+                    readAt(ctx, image, blockOffset(ctx, src), batch + k * ctx->blockSize, ctx->blockSize);
+                }
+                if (dst == JOURNAL_SCRATCH) {
+                    memcpy(scratch, batch + k * ctx->blockSize, ctx->blockSize);
+                }
+            }
+            writeAt(ctx, journal, ctx->journalBatchOffset, batch, header->pending * ctx->blockSize);
+            syncFile(journal); // batch content must be durable before the header claims it
+            saveJournalHeader(ctx, journal, header);
+        } else {
+            // recovering: the batch is in journal, image may be partially updated
+            readAt(ctx, journal, ctx->journalBatchOffset, batch, header->pending * ctx->blockSize);
+        }
+
+        for (k = 0; k < header->pending; k++) {
+            int dst = moves[2 * (header->done + k)];
+            if (dst == JOURNAL_SCRATCH) {
+                writeAt(ctx, journal, ctx->journalScratchOffset, batch + k * ctx->blockSize, ctx->blockSize);
+                memcpy(scratch, batch + k * ctx->blockSize, ctx->blockSize);
+            } else {
+                writeAt(ctx, image, blockOffset(ctx, dst), batch + k * ctx->blockSize, ctx->blockSize);
+            }
+        }
+        syncFile(image);
+
+        header->done += header->pending;
+        header->pending = 0;
+        saveJournalHeader(ctx, journal, header);
+    }
+
+    free(batch);
+    free(scratch);
+}
+
+/**
+ * Last step of in-place mode: write indirect blocks, inodes and super block from journal,
+ * then link free blocks by writing only the next pointers which change
+ * Every write here is idempotent, so it is simply redone after a crash
+ */
+void finishInPlace(defragContext *ctx, FILE *image, FILE *journal, journalHeader *header) {
+    int i;
+    char *buffer = malloc(ctx->blockSize);
+
+    for (i = 0; i < header->indirectCount; i++) {
+        int dst;
+        off_t offset = ctx->journalIndirectOffset + (off_t) i * (sizeof(int) + ctx->blockSize);
+        readAt(ctx, journal, offset, &dst, sizeof(int));
+        readAt(ctx, journal, offset + sizeof(int), buffer, ctx->blockSize);
+        writeAt(ctx, image, blockOffset(ctx, dst), buffer, ctx->blockSize);
+    }
+
+    readAt(ctx, journal, ctx->journalMetaOffset + DEFAULT_BLOCK_SIZE, ctx->inodeTable, ctx->inodeRegionSize);
+    writeInodes(ctx, image);
+
+    for (i = 0; i < header->freeUpdateCount; i++) {
+        int update[2];
+        readAt(ctx, journal, ctx->journalFreeOffset + (off_t) i * sizeof(update), update, sizeof(update));
+        writeAt(ctx, image, blockOffset(ctx, update[0]), &update[1], sizeof(int));
+    }
+
+    readAt(ctx, journal, ctx->journalMetaOffset, ctx->superBlock, DEFAULT_BLOCK_SIZE);
+    writeAt(ctx, image, DEFAULT_BLOCK_SIZE, ctx->superBlock, DEFAULT_BLOCK_SIZE);
+    syncFile(image);
+
+    free(buffer);
+}
+
+/**
+ * Defragment the image in place, using a journal file as crash protection
+ * If the journal already exists, a previous run was interrupted: it is recovered and completed
+ * instead of starting over, the image is not planned again in this case
+ * Only data blocks which actually move, changed indirect blocks and free list pointers, and metadata are written
+ * With incremental option, only fragmented files move, so the amount written follows fragmentation
+ * Note that blocks lost from the free list are linked back into it
+ * @param image The image file pointer, opened for both reading and writing
+ * @param journalName Path of journal file, removed after a successful run
+ * @return 0 on success, non-zero if a fatal error is found, details are in contextError
+ */
+int defragmentInPlace(defragContext *ctx, FILE *image, const char *journalName) {
+    journalHeader header;
+    int *moves;
+    ctx->error = ERROR_ALL_GREEN;
+    ctx->options.sparse = 0; // image is rewritten over its old content, a skipped block would keep stale data
+    statMark(ctx);
+
+    if (loadIndex(ctx, image) != 0) {
+        return 1;
+    }
+    dumpSuperBlock(ctx, ctx->superBlock);
+    statPhase(ctx, PHASE_LOAD);
+
+    FILE *journal = fopen(journalName, "r+");
+    if (journal != NULL) {
+        printf("Recovering interrupted run from %s\n", journalName);
+        readAt(ctx, journal, 0, &header, sizeof(journalHeader));
+        if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || header.blockSize != ctx->blockSize) {
+            fclose(journal);
+            releasePlan(ctx);
+            ctx->error |= ERROR_DATA_BLOCK_LOST;
+            return 1;
+        }
+        locateJournalParts(ctx, &header);
+        moves = malloc(header.moveCount * 2 * sizeof(int) + 1);
+        readAt(ctx, journal, ctx->journalMoveOffset, moves, header.moveCount * 2 * sizeof(int));
+    } else {
+        size_t inodeCount = ctx->index.inodeCount;
+        indexBlocks(ctx, image); // a recovered run takes its moves from the journal instead
+        if (ctx->options.incremental) {
+            planIncremental(ctx, inodeCount);
+        } else {
+            planAllFiles(ctx, inodeCount);
+        }
+        if ((ctx->error & ERROR_FATAL) != ERROR_ALL_GREEN) { // never touch an image we cannot fully relocate
+            releasePlan(ctx);
+            return 1;
+        }
+
+        journal = fopen(journalName, "w+");
+        if (journal == NULL) {
+            releasePlan(ctx);
+            return 1;
+        }
+        memset(&header, 0, sizeof(journalHeader));
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.blockSize = (int) ctx->blockSize;
+        header.dataRegion = ctx->dataRegion;
+        int *freeUpdates = planFreeListUpdates(ctx, image, &header.freeUpdateCount);
+        moves = planMoves(ctx, &header.moveCount);
+        if (ctx->options.compactInodes) {
+            compactInodeTable(ctx);
+        }
+        statPhase(ctx, PHASE_PLAN);
+        writeJournal(ctx, image, journal, &header, moves, freeUpdates);
+        free(freeUpdates);
+    }
+    statPhase(ctx, PHASE_JOURNAL);
+
+    applyMoves(ctx, image, journal, &header, moves);
+    statPhase(ctx, PHASE_COPY);
+    finishInPlace(ctx, image, journal, &header);
+    statPhase(ctx, PHASE_FINISH);
+
+    fclose(journal);
+    remove(journalName);
+    free(moves);
+    releasePlan(ctx);
+
+    return (ctx->error & ERROR_FATAL) != ERROR_ALL_GREEN;
+}
+
+/*********************** From there, functions are parts of patch writer and applier ***********************/
+
+/**
+ * A patch holds only the bytes a run changes, so the run can be shipped as a small file and applied where
+ * the image lives, see patchHeader in defrag.h for its format
+ * The defragmented image is never built: output blocks are derived from the plan a window at a time, in
+ * ascending order, and compared with the input by sectors of DEFAULT_BLOCK_SIZE bytes; runs of changed
+ * sectors become extents, so the patch comes out in the order applyPatch writes it
+ */
+#define PATCH_EXTENT_BYTES COPY_WINDOW_BYTES // longest extent, and span of output built at once
+
+// state of a patch being written, see patchDefragmenter
+typedef struct {
+    FILE *patch;
+    char *content;   /* new content of the open extent */
+    off_t offset;    /* image offset of the open extent */
+    size_t length;   /* bytes in the open extent, 0 if none is open */
+    uint32_t oldCrc; /* CRC32C of what the open extent replaces */
+    size_t extents;  /* extents written so far */
+    size_t bytes;    /* content bytes written so far */
+    int failed;      /* non-zero once the patch cannot be written */
+} patchWriter;
+
+/**
+ * Read length bytes of the image from offset, what lies past its end reads as zeros, as applyPatch does
+ */
+void readBase(defragContext *ctx, int fd, off_t offset, char *buffer, size_t length) {
+    ssize_t got = pread(fd, buffer, length, offset);
+    got = got > 0 ? got : 0;
+    if (got > 0) {
+        countIo(ctx, 0, offset, (size_t) got, IO_REQUEST);
+    }
+    memset(buffer + got, 0, length - (size_t) got);
+}
+
+/**
+ * Write a record, then content of length bytes after it
+ */
+void writeRecord(defragContext *ctx, patchWriter *pw, patchRecord *record, const char *content) {
+    off_t position = ftello(pw->patch);
+    if (fwrite(record, sizeof(patchRecord), 1, pw->patch) != 1 ||
+        (record->length > 0 && fwrite(content, 1, record->length, pw->patch) != record->length)) {
+        pw->failed = 1;
+        return;
+    }
+    countIo(ctx, 1, position, sizeof(patchRecord) + record->length, IO_REQUEST);
+}
+
+/**
+ * Write the open extent into the patch, if any
+ */
+void closeExtent(defragContext *ctx, patchWriter *pw) {
+    patchRecord record;
+    if (pw->length == 0) {
+        return;
+    }
+    memset(&record, 0, sizeof(patchRecord));
+    record.offset = pw->offset;
+    record.length = (uint32_t) pw->length;
+    record.oldCrc = pw->oldCrc;
+    record.newCrc = crc32c(0, pw->content, pw->length);
+    writeRecord(ctx, pw, &record, pw->content);
+    pw->extents++;
+    pw->bytes += pw->length;
+    pw->length = 0;
+}
+
+/**
+ * Compare new content of the image at offset with what the image holds there, sector by sector,
+ * and add every changed sector to the open extent; spans are given in ascending offset order
+ * @param content New content, length bytes
+ * @param base Current content, length bytes
+ */
+void patchCompare(defragContext *ctx, patchWriter *pw, off_t offset, const char *content, const char *base,
+                  size_t length) {
+    size_t done, n;
+    for (done = 0; done < length; done += n) {
+        off_t at = offset + (off_t) done;
+        n = DEFAULT_BLOCK_SIZE - (size_t) (at % DEFAULT_BLOCK_SIZE); // sectors are aligned on the image
+        n = n < length - done ? n : length - done;
+        if (memcmp(content + done, base + done, n) == 0) {
+            continue;
+        }
+        if (pw->length > 0 && (pw->offset + (off_t) pw->length != at || pw->length + n > PATCH_EXTENT_BYTES)) {
+            closeExtent(ctx, pw);
+        }
+        if (pw->length == 0) {
+            pw->offset = at;
+            pw->oldCrc = 0;
+        }
+        memcpy(pw->content + pw->length, content + done, n);
+        pw->oldCrc = crc32c(pw->oldCrc, base + done, n);
+        pw->length += n;
+    }
+}
+
+/**
+ * Compare a span of new content with the image, reading the image a window at a time
+ * @param content New content, NULL for zeros
+ */
+void patchSpan(defragContext *ctx, patchWriter *pw, int fd, off_t offset, const char *content, size_t length) {
+    char *base = malloc(PATCH_EXTENT_BYTES);
+    char *zeros = content == NULL ? calloc(1, PATCH_EXTENT_BYTES) : NULL;
+    size_t done, n;
+    for (done = 0; done < length; done += n) {
+        n = length - done < PATCH_EXTENT_BYTES ? length - done : PATCH_EXTENT_BYTES;
+        readBase(ctx, fd, offset + (off_t) done, base, n);
+        patchCompare(ctx, pw, offset + (off_t) done, content != NULL ? content + done : zeros, base, n);
+    }
+    free(zeros);
+    free(base);
+}
+
+/**
+ * Compare data region of the defragmented image with the input, a window of output blocks at a time
+ * A block keeping its place and content, i.e. not an indirect block, is neither read nor compared;
+ * the others are built as copy pass and writeFreeList would write them: moved blocks are read in source
+ * order and translated, free blocks hold their next pointer only, blocks of lost sources are zeros
+ */
+void patchDataRegion(defragContext *ctx, patchWriter *pw, int fd) {
+    int o, k, b, n, m, run;
+    int window = PATCH_EXTENT_BYTES / ctx->blockSize > 0 ? PATCH_EXTENT_BYTES / ctx->blockSize : 1;
+    int *origin = malloc(sizeof(int) * (ctx->dataRegion + 1)); // input block of every output block, -1 if none
+    int *sources = malloc(sizeof(int) * window);
+    char *content = allocBlocks(window, ctx->blockSize);
+    char *base = allocBlocks(window, ctx->blockSize);
+    char *staging = allocBlocks(window, ctx->blockSize);
+
+    memset(origin, -1, sizeof(int) * ctx->dataRegion);
+    for (k = 0; k < ctx->dataRegion; k++) {
+        if (ctx->relocation[k] >= 0 && ctx->relocation[k] < ctx->dataRegion) {
+            origin[ctx->relocation[k]] = k;
+        }
+    }
+
+    for (o = 0; o < ctx->dataRegion && !pw->failed; o += n) {
+        n = ctx->dataRegion - o < window ? ctx->dataRegion - o : window;
+        char *kept = calloc(n, 1); // blocks known unchanged
+        for (b = 0; b < n; b++) {
+            kept[b] = ctx->usedMap[o + b] && origin[o + b] == o + b && ctx->pointerCount[o + b] == 0;
+        }
+
+        // current content of the others, in runs
+        for (b = 0; b < n; b += run) {
+            for (run = 1; b + run < n && kept[b + run] == kept[b]; run++);
+            if (!kept[b]) {
+                readBase(ctx, fd, blockOffset(ctx, o + b), base + (size_t) b * ctx->blockSize,
+                         (size_t) run * ctx->blockSize);
+            }
+        }
+
+        // new content
+        for (b = 0, m = 0; b < n; b++) {
+            char *block = content + (size_t) b * ctx->blockSize;
+            int at = o + b, next;
+            if (kept[b]) {
+                continue;
+            }
+            memset(block, 0, ctx->blockSize);
+            if (!ctx->usedMap[at]) {
+                for (next = at + 1; next < ctx->dataRegion && ctx->usedMap[next]; next++);
+                next = next < ctx->dataRegion ? next : -1;
+                memcpy(block, &next, sizeof(int));
+            } else if (origin[at] == at) {
+                memcpy(block, base + (size_t) b * ctx->blockSize, ctx->blockSize);
+            } else if (origin[at] >= 0) {
+                sources[m++] = origin[at];
+            }
+        }
+        qsort(sources, m, sizeof(int), compareIndex);
+        for (k = 0; k < m; k += run) {
+            for (run = 1; k + run < m && sources[k + run] == sources[k] + run; run++);
+            readBase(ctx, fd, blockOffset(ctx, sources[k]), staging, (size_t) run * ctx->blockSize);
+            for (b = 0; b < run; b++) {
+                memcpy(content + (size_t) (ctx->relocation[sources[k + b]] - o) * ctx->blockSize,
+                       staging + (size_t) b * ctx->blockSize, ctx->blockSize);
+            }
+        }
+        for (b = 0; b < n; b++) {
+            if (!kept[b] && ctx->usedMap[o + b] && origin[o + b] >= 0 && ctx->pointerCount[origin[o + b]] > 0) {
+                translatePointers(ctx, origin[o + b], (int *) (content + (size_t) b * ctx->blockSize));
+            }
+        }
+
+        for (b = 0; b < n; b += run) {
+            for (run = 1; b + run < n && kept[b + run] == kept[b]; run++);
+            if (!kept[b]) {
+                patchCompare(ctx, pw, blockOffset(ctx, o + b), content + (size_t) b * ctx->blockSize,
+                             base + (size_t) b * ctx->blockSize, (size_t) run * ctx->blockSize);
+            }
+        }
+        free(kept);
+    }
+
+    free(staging);
+    free(base);
+    free(content);
+    free(sources);
+    free(origin);
+}
+
+/**
+ * Plan a run over the image in inFile as defragmenter does, but write a patch holding only what the run changes
+ * instead of an output image; applied with applyPatch, the patch turns the image into what defragmenter gives
+ * Super block, inode region and data region are compared in ascending order, swap region never changes
+ * Engine, threads and sparse options are ignored, nothing is written but the patch
+ * @param patchFile Patch, written once from its current position
+ * @return 0 on success, 1 if planning finds a fatal error (no patch is written then) or the patch cannot be written
+ */
+int patchDefragmenter(defragContext *ctx, FILE *inFile, FILE *patchFile) {
+    patchWriter pw;
+    patchHeader header;
+    patchRecord closing;
+    struct stat status;
+    ctx->error = ERROR_ALL_GREEN;
+    statMark(ctx);
+
+    if (loadIndex(ctx, inFile) != 0) {
+        return 1;
+    }
+    dumpSuperBlock(ctx, ctx->superBlock);
+    indexBlocks(ctx, inFile);
+    statPhase(ctx, PHASE_LOAD);
+
+    if (ctx->options.incremental) {
+        planIncremental(ctx, ctx->index.inodeCount);
+    } else {
+        planAllFiles(ctx, ctx->index.inodeCount);
+    }
+    if ((ctx->error & ERROR_FATAL) != ERROR_ALL_GREEN) { // the patch goes onto the image, it must lose nothing
+        releasePlan(ctx);
+        return 1;
+    }
+    if (ctx->options.compactInodes) {
+        compactInodeTable(ctx);
+    }
+    ctx->superBlock->free_iblock = freeListHead(ctx);
+    statPhase(ctx, PHASE_PLAN);
+
+    memset(&pw, 0, sizeof(patchWriter));
+    pw.patch = patchFile;
+    pw.content = malloc(PATCH_EXTENT_BYTES);
+    memset(&header, 0, sizeof(patchHeader));
+    memcpy(header.magic, PATCH_MAGIC, sizeof(header.magic));
+    header.imageSize = fstat(fileno(inFile), &status) == 0 ? status.st_size : 0;
+    header.blockSize = (int) ctx->blockSize;
+    pw.failed = fwrite(&header, sizeof(patchHeader), 1, patchFile) != 1;
+
+    // super block, then zeros up to inode region, as defragmenter leaves them, then inode region
+    int fd = fileno(inFile);
+    patchSpan(ctx, &pw, fd, DEFAULT_BLOCK_SIZE, (const char *) ctx->superBlock, DEFAULT_BLOCK_SIZE);
+    patchSpan(ctx, &pw, fd, 2 * DEFAULT_BLOCK_SIZE, NULL, (size_t) (ctx->inodeInitial - 2 * DEFAULT_BLOCK_SIZE));
+    patchSpan(ctx, &pw, fd, ctx->inodeInitial, (const char *) ctx->inodeTable, ctx->inodeRegionSize);
+    statPhase(ctx, PHASE_INODES);
+    patchDataRegion(ctx, &pw, fd);
+    closeExtent(ctx, &pw);
+    statPhase(ctx, PHASE_COPY);
+
+    memset(&closing, 0, sizeof(patchRecord));
+    closing.offset = header.imageSize;
+    writeRecord(ctx, &pw, &closing, NULL);
+    if (fflush(patchFile) != 0) {
+        pw.failed = 1;
+    }
+    statPhase(ctx, PHASE_SYNC);
+    if (!pw.failed) {
+        printf("Patch holds %zu extents, %zu of %lld bytes\n", pw.extents, pw.bytes, (long long) header.imageSize);
+    }
+
+    free(pw.content);
+    releasePlan(ctx);
+    return pw.failed;
+}
+
+/**
+ * Read the next record of a patch and the content following it
+ * @return 0 on success, -1 if the patch is cut short or a record is malformed
+ */
+int readRecord(defragContext *ctx, FILE *patchFile, patchRecord *record, char *content) {
+    off_t position = ftello(patchFile);
+    if (fread(record, sizeof(patchRecord), 1, patchFile) != 1 || record->length > PATCH_EXTENT_BYTES ||
+        record->offset < 0 || fread(content, 1, record->length, patchFile) != record->length) {
+        return -1;
+    }
+    countIo(ctx, 0, position, sizeof(patchRecord) + record->length, IO_REQUEST);
+    return 0;
+}
+
+/**
+ * Apply a patch written by patchDefragmenter to the image it was made from, which may be the live device
+ * Every extent is checked before anything is written: the image must hold there what the patch replaces,
+ * or the new content already, so a patch of another image is refused and an interrupted apply can run again
+ * Extents are then written in ascending offset order, and the image is synced
+ * @param patchFile Patch, read twice, so it cannot be a pipe
+ * @param image Image to be patched, opened for update
+ * @return 0 on success, 1 if the patch is damaged or was not made from this image, nothing is written then,
+ *         2 if writing the image fails part way
+ */
+int applyPatch(defragContext *ctx, FILE *patchFile, FILE *image) {
+    patchHeader header;
+    patchRecord record;
+    struct stat status;
+    size_t extents = 0, present = 0, bytes = 0;
+    int fd = fileno(image), result = 0;
+    char *content = malloc(PATCH_EXTENT_BYTES);
+    char *current = malloc(PATCH_EXTENT_BYTES);
+    ctx->error = ERROR_ALL_GREEN;
+    releasePlan(ctx); // the image changes under a metadata index loaded from it
+    statMark(ctx);
+    fflush(image);
+
+    if (fread(&header, sizeof(patchHeader), 1, patchFile) != 1 ||
+        memcmp(header.magic, PATCH_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Not a patch made by defrag\n");
+        result = 1;
+    } else if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size != header.imageSize) {
+        fprintf(stderr, "Patch is for an image of %lld bytes, this one has %lld\n",
+                (long long) header.imageSize, (long long) status.st_size);
+        result = 1;
+    }
+
+    // check every extent against the image
+    off_t start = ftello(patchFile);
+    while (result == 0) {
+        if (readRecord(ctx, patchFile, &record, content) != 0) {
+            fprintf(stderr, "Patch is cut short or damaged\n");
+            result = 1;
+            break;
+        }
+        if (record.length == 0) {
+            break;
+        }
+        readBase(ctx, fd, record.offset, current, record.length);
+        if (crc32c(0, content, record.length) != record.newCrc) {
+            fprintf(stderr, "Patch is damaged at offset %lld\n", (long long) record.offset);
+            result = 1;
+        } else if (memcmp(current, content, record.length) == 0) {
+            present++; // written by an earlier, interrupted apply
+        } else if (crc32c(0, current, record.length) != record.oldCrc) {
+            fprintf(stderr, "Image differs from the one the patch was made from, at offset %lld\n",
+                    (long long) record.offset);
+            result = 1;
+        }
+        extents++;
+    }
+    statPhase(ctx, PHASE_VERIFY);
+
+    // write them in ascending order
+    if (result == 0 && fseeko(patchFile, start, SEEK_SET) != 0) {
+        perror("Cannot read patch again");
+        result = 1;
+    }
+    while (result == 0 && readRecord(ctx, patchFile, &record, content) == 0 && record.length > 0) {
+        if (pwrite(fd, content, record.length, record.offset) != record.length) {
+            perror("Cannot write image");
+            result = 2;
+            break;
+        }
+        countIo(ctx, 1, record.offset, record.length, IO_REQUEST);
+        bytes += record.length;
+    }
+    statPhase(ctx, PHASE_COPY);
+    if (result == 0 && fsync(fd) != 0) {
+        perror("Cannot sync image");
+        result = 2;
+    }
+    statPhase(ctx, PHASE_SYNC);
+    if (result == 0) {
+        printf("Applied %zu extents (%zu bytes), %zu of them were in place already\n", extents, bytes, present);
+    }
+
+    free(current);
+    free(content);
+    return result;
+}
+
+/*********************** From there, functions are parts of streaming defragmenter ***********************/
+
+#define STREAM_PENDING (-2) /* source of an output block, unknown until the indirect block pointing to it is read */
+#define STREAM_NOWHERE (-1) /* input block not parked in reorder buffer */
+
+// state of a streamed run, input and output are never seeked, see streamDefragmenter
+typedef struct {
+    FILE *in;
+    FILE *out;
+    off_t inOffset;           /* bytes consumed from input */
+    off_t outOffset;          /* bytes produced into output */
+    int failed;               /* non-zero once a read, write or spill failed, the output is incomplete */
+
+    // output layout, built from inode sizes before any data block is read, indexed by output block
+    int *source;              /* input block of every output block, STREAM_PENDING, or -1 if lost */
+    int *firstChild;          /* first entry of an indirect block in children */
+    unsigned short *liveCount; /* live pointers of an indirect block, 0 for a data block */
+    int *children;            /* output blocks indexed by every indirect block, in pointer order */
+    int childCount;           /* entries used in children */
+    int pending;              /* output blocks whose source is STREAM_PENDING */
+
+    // reorder buffer, input blocks which arrived before their turn in output
+    int *parked;              /* slot of every input block: memory slot, memorySlots + spill slot, or STREAM_NOWHERE */
+    char *memory;             /* memorySlots blocks */
+    int memorySlots;
+    int *freeMemory;          /* stack of free memory slots */
+    int freeMemoryCount;
+    int spill;                /* descriptor of the temporary file, -1 until memory is full */
+    int spillSlots;           /* blocks the temporary file has grown to */
+    int *freeSpill;           /* stack of free spill slots */
+    int freeSpillCount;
+    int spillCapacity;        /* entries freeSpill has room for, at least spillSlots */
+} streamState;
+
+/**
+ * Read the next length bytes of input
+ * @return 0 on success, -1 if input ended before
+ */
+int streamRead(defragContext *ctx, streamState *st, void *buffer, size_t length) {
+    if (fread(buffer, 1, length, st->in) != length) {
+        st->failed = 1;
+        return -1;
+    }
+    countIo(ctx, 0, st->inOffset, length, IO_REQUEST);
+    st->inOffset += length;
+    return 0;
+}
+
+/**
+ * Read and drop the next length bytes of input, through buffer of one block
+ */
+int streamSkip(defragContext *ctx, streamState *st, void *buffer, off_t length) {
+    while (length > 0) {
+        size_t n = length < (off_t) ctx->blockSize ? (size_t) length : ctx->blockSize;
+        if (streamRead(ctx, st, buffer, n) != 0) {
+            return -1;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Append length bytes to output, NULL for zeros
+ */
+void streamWrite(defragContext *ctx, streamState *st, const void *buffer, size_t length) {
+    static const char zeros[DEFAULT_BLOCK_SIZE];
+    while (buffer == NULL && length > 0) {
+        size_t n = length < sizeof(zeros) ? length : sizeof(zeros);
+        streamWrite(ctx, st, zeros, n);
+        length -= n;
+    }
+    if (buffer == NULL || length == 0) {
+        return;
+    }
+    if (fwrite(buffer, 1, length, st->out) != length) {
+        st->failed = 1;
+        return;
+    }
+    countIo(ctx, 1, st->outOffset, length, IO_REQUEST);
+    st->outOffset += length;
+}
+
+/**
+ * Open an anonymous temporary file under $TMPDIR, /tmp by default, for blocks the memory cannot hold
+ * @return Its descriptor, -1 on failure
+ */
+int openSpill() {
+    const char *directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char *name = malloc(strlen(directory) + sizeof("/defrag-spill-XXXXXX"));
+    strcpy(name, directory);
+    strcat(name, "/defrag-spill-XXXXXX");
+    int fd = mkstemp(name);
+    if (fd >= 0) {
+        unlink(name); // gone with the descriptor
+    }
+    free(name);
+    return fd;
+}
+
+/**
+ * Keep input block blk until its turn in output comes: in memory while a slot is free, else in the temporary file
+ */
+void streamPark(defragContext *ctx, streamState *st, int blk, const char *block) {
+    if (st->freeMemoryCount > 0) {
+        int slot = st->freeMemory[--st->freeMemoryCount];
+        memcpy(st->memory + (size_t) slot * ctx->blockSize, block, ctx->blockSize);
+        st->parked[blk] = slot;
+        return;
+    }
+    if (st->spill < 0 && (st->spill = openSpill()) < 0) {
+        perror("Cannot create temporary file for reorder buffer");
+        st->failed = 1;
+        return;
+    }
+    int slot = st->freeSpillCount > 0 ? st->freeSpill[--st->freeSpillCount] : st->spillSlots++;
+    if (st->spillSlots > st->spillCapacity) { // keep room to free every slot
+        st->spillCapacity = st->spillCapacity > 0 ? st->spillCapacity * 2 : st->memorySlots;
+        st->freeSpill = realloc(st->freeSpill, sizeof(int) * st->spillCapacity);
+    }
+    if (pwrite(st->spill, block, ctx->blockSize, (off_t) slot * ctx->blockSize) != (ssize_t) ctx->blockSize) {
+        perror("Cannot write temporary file for reorder buffer");
+        st->failed = 1;
+        return;
+    }
+    st->parked[blk] = st->memorySlots + slot;
+    ctx->stats.bytesSpilled += ctx->blockSize;
+}
+
+/**
+ * Copy parked input block blk into block, it stays parked
+ */
+void streamFetch(defragContext *ctx, streamState *st, int blk, char *block) {
+    int slot = st->parked[blk];
+    if (slot < st->memorySlots) {
+        memcpy(block, st->memory + (size_t) slot * ctx->blockSize, ctx->blockSize);
+    } else if (pread(st->spill, block, ctx->blockSize, (off_t) (slot - st->memorySlots) * ctx->blockSize) !=
+               (ssize_t) ctx->blockSize) {
+        perror("Cannot read temporary file for reorder buffer");
+        st->failed = 1;
+    }
+}
+
+/**
+ * Release the slot of parked input block blk
+ */
+void streamUnpark(streamState *st, int blk) {
+    int slot = st->parked[blk];
+    if (slot < st->memorySlots) {
+        st->freeMemory[st->freeMemoryCount++] = slot;
+    } else {
+        st->freeSpill[st->freeSpillCount++] = slot - st->memorySlots;
+    }
+    st->parked[blk] = STREAM_NOWHERE;
+}
+
+/**
+ * Give a block and, for an indirect block, the tree below it their output blocks the way planTree does,
+ * knowing only how many data blocks are left, since no indirect block has been read yet
+ * Children of an indirect block are listed together in children, to be resolved once it is read
+ * @param depth 0 for a data block, 1 for I1, 2 for I2 and 3 for I3 block
+ * @return Output block of this block
+ */
+int streamTree(defragContext *ctx, streamState *st, int depth, size_t *dataCount, planCursor *cursor) {
+    int position = depth > 0 && cursor->nextIndirect >= 0 ? cursor->nextIndirect++ : cursor->next++;
+    st->source[position] = STREAM_PENDING;
+    st->pending++;
+    if (depth == 0) {
+        (*dataCount)--;
+        return position;
+    }
+
+    // planTree takes children while data blocks remain, a full child holding fanout^(depth-1) of them
+    size_t fanout = ctx->kernels.fanout, span = 1;
+    int i, count;
+    for (i = 1; i < depth; i++) {
+        span *= fanout;
+    }
+    count = (int) ((*dataCount + span - 1) / span < fanout ? (*dataCount + span - 1) / span : fanout);
+    int first = st->childCount;
+    st->firstChild[position] = first;
+    st->liveCount[position] = (unsigned short) count;
+    st->childCount += count;
+    for (i = 0; i < count; i++) {
+        st->children[first + i] = streamTree(ctx, st, depth - 1, dataCount, cursor);
+    }
+    return position;
+}
+
+void streamChildren(defragContext *ctx, streamState *st, int position, const int *content);
+
+/**
+ * Learn that output block position comes from input block blk, and claim blk
+ * A block out of data region, or claimed already, is lost, and so is the tree below it
+ * An indirect block which went by already is fetched from reorder buffer to resolve its children at once
+ */
+void streamResolve(defragContext *ctx, streamState *st, int position, int blk) {
+    int i;
+    st->pending--;
+    if (blk < 0 || blk >= ctx->dataRegion || ctx->relocation[blk] >= 0) {
+        ctx->error |= ERROR_DATA_BLOCK_LOST;
+        st->source[position] = -1;
+        for (i = 0; i < st->liveCount[position]; i++) {
+            streamResolve(ctx, st, st->children[st->firstChild[position] + i], -1);
+        }
+        return;
+    }
+    st->source[position] = blk;
+    ctx->relocation[blk] = position;
+    if (st->liveCount[position] > 0 && st->parked[blk] != STREAM_NOWHERE) {
+        int *content = malloc(ctx->blockSize);
+        streamFetch(ctx, st, blk, (char *) content);
+        streamChildren(ctx, st, position, content);
+        free(content);
+    }
+}
+
+/**
+ * Resolve the children of indirect output block position from the content of its input block
+ */
+void streamChildren(defragContext *ctx, streamState *st, int position, const int *content) {
+    int i;
+    ctx->pointerCount[st->source[position]] = st->liveCount[position];
+    for (i = 0; i < st->liveCount[position]; i++) {
+        streamResolve(ctx, st, st->children[st->firstChild[position] + i], content[i]);
+    }
+}
+
+/**
+ * Lay out every block of a file from its range given by layoutFiles, see planSingleFile
+ * Pointer fields of inode are updated to the new locations, and the blocks they held are resolved
+ */
+void streamFile(defragContext *ctx, streamState *st, inode *inode, int start) {
+    int i, blk;
+    planCursor cursor;
+    size_t dataCount = dataBlockCount(ctx, inode->size);
+    memset(&cursor, 0, sizeof(planCursor));
+    cursor.start = cursor.next = start;
+    cursor.nextIndirect = -1;
+    if (ctx->options.indirectFirst) {
+        cursor.nextIndirect = cursor.next;
+        cursor.next += (int) indirectBlockCount(ctx, inode->size);
+    }
+
+    int *roots[N_ROOTS];
+    int depths[N_ROOTS];
+    int n = inodeRoots(inode, roots, depths);
+    for (i = 0; i < n && dataCount > 0; i++) {
+        blk = *roots[i];
+        *roots[i] = streamTree(ctx, st, depths[i], &dataCount, &cursor);
+        streamResolve(ctx, st, *roots[i], blk);
+    }
+    if (dataCount > 0) {
+        ctx->error |= ERROR_DATA_BLOCK_LOST;
+        perror("Not all blocks written!");
+    }
+}
+
+/**
+ * Write output block position: translated content of its source, or zeros for a lost block
+ * @param blk Source of the block, -1 if lost
+ * @param block Content of blk, rewritten for an indirect block
+ */
+void streamEmit(defragContext *ctx, streamState *st, int position, int blk, char *block) {
+    if (blk < 0) {
+        streamWrite(ctx, st, NULL, ctx->blockSize);
+        return;
+    }
+    if (st->liveCount[position] > 0) {
+        translatePointers(ctx, blk, (int *) block);
+    }
+    streamWrite(ctx, st, block, ctx->blockSize);
+}
+
+/**
+ * Stream data region: input blocks are read in order, and output blocks written in order
+ * An input block is written right away if its turn has come, else it is parked until it comes, or until
+ * the layout is fully known and nothing points to it any more, then it is dropped
+ */
+void streamDataRegion(defragContext *ctx, streamState *st) {
+    char *block = ctx->copyBuffer;
+    int in = 0, out = 0, blk, position;
+    int swept = 0;
+    while (out < ctx->dataBlockIndex && !st->failed) {
+        blk = st->source[out];
+        if (blk == -1 || (blk >= 0 && st->parked[blk] != STREAM_NOWHERE)) {
+            if (blk >= 0) {
+                streamFetch(ctx, st, blk, block);
+                streamUnpark(st, blk);
+            }
+            streamEmit(ctx, st, out++, blk, block);
+            continue;
+        }
+        if (in == ctx->dataRegion) { // unreachable on a consistent layout, every source is known by now
+            ctx->error |= ERROR_DATA_BLOCK_LOST;
+            streamEmit(ctx, st, out++, -1, block);
+            continue;
+        }
+
+        if (streamRead(ctx, st, block, ctx->blockSize) != 0) {
+            fprintf(stderr, "Input ends inside data region\n");
+            return;
+        }
+        position = ctx->relocation[in];
+        if (position >= 0 && st->liveCount[position] > 0) {
+            streamChildren(ctx, st, position, (int *) block);
+        }
+        if (position >= 0 && position == out) {
+            streamEmit(ctx, st, out++, in, block);
+        } else if (position >= 0 || st->pending > 0) { // may be claimed once an indirect block arrives
+            streamPark(ctx, st, in, block);
+        }
+        in++;
+
+        if (st->pending == 0 && !swept) { // whatever is parked and unclaimed is free space
+            for (blk = 0; blk < in; blk++) {
+                if (st->parked[blk] != STREAM_NOWHERE && ctx->relocation[blk] < 0) {
+                    streamUnpark(st, blk);
+                }
+            }
+            swept = 1;
+        }
+    }
+    if (!st->failed) {
+        streamSkip(ctx, st, block, (off_t) (ctx->dataRegion - in) * ctx->blockSize);
+    }
+}
+
+/**
+ * Write the data free list, every block past the files linked in ascending order, see writeFreeList
+ */
+void streamFreeList(defragContext *ctx, streamState *st) {
+    int i, pointer;
+    memset(ctx->copyBuffer, 0, ctx->blockSize);
+    for (i = ctx->dataBlockIndex; i < ctx->dataRegion && !st->failed; i++) {
+        pointer = i + 1 < ctx->dataRegion ? i + 1 : -1;
+        memcpy(ctx->copyBuffer, &pointer, sizeof(int));
+        streamWrite(ctx, st, ctx->copyBuffer, ctx->blockSize);
+    }
+}
+
+/**
+ * Copy swap region, i.e. whatever input holds past data region
+ */
+void streamSwapRegion(defragContext *ctx, streamState *st) {
+    size_t n;
+    while (!st->failed && (n = fread(ctx->copyBuffer, 1, ctx->blockSize, st->in)) > 0) {
+        countIo(ctx, 0, st->inOffset, n, IO_REQUEST);
+        st->inOffset += n;
+        streamWrite(ctx, st, ctx->copyBuffer, n);
+    }
+    if (ferror(st->in)) {
+        st->failed = 1;
+    }
+}
+
+/**
+ * Lay out the image from super block and inode region, which come first in input,
+ * and allocate the reorder buffer
+ * @return 0 on success, -1 if files do not fit in data region
+ */
+int streamLayout(defragContext *ctx, streamState *st) {
+    size_t i, inodeCount = ctx->inodeRegionSize / inodeSize;
+    allocatePlan(ctx);
+    ctx->dataBlockIndex = layoutFiles(ctx, inodeCount);
+    if (ctx->dataBlockIndex > ctx->dataRegion) {
+        return -1;
+    }
+    ctx->superBlock->free_iblock = ctx->dataBlockIndex < ctx->dataRegion ? ctx->dataBlockIndex : -1;
+
+    st->source = malloc(sizeof(int) * (ctx->dataBlockIndex + 1));
+    st->firstChild = malloc(sizeof(int) * (ctx->dataBlockIndex + 1));
+    st->liveCount = calloc(ctx->dataBlockIndex + 1, sizeof(unsigned short));
+    st->children = malloc(sizeof(int) * (ctx->dataBlockIndex + 1));
+    st->parked = malloc(sizeof(int) * ctx->dataRegion);
+    memset(st->parked, -1, sizeof(int) * ctx->dataRegion);
+
+    size_t slots = ctx->options.streamMemory / ctx->blockSize;
+    st->memorySlots = (int) (slots < (size_t) ctx->dataRegion ? slots : (size_t) ctx->dataRegion);
+    st->memorySlots = st->memorySlots > 0 ? st->memorySlots : 1;
+    st->memory = allocBlocks(st->memorySlots, ctx->blockSize);
+    st->freeMemory = malloc(sizeof(int) * st->memorySlots);
+    for (st->freeMemoryCount = 0; st->freeMemoryCount < st->memorySlots; st->freeMemoryCount++) {
+        st->freeMemory[st->freeMemoryCount] = st->memorySlots - 1 - st->freeMemoryCount;
+    }
+    st->spill = -1;
+
+    for (i = 0; i < inodeCount; i++) {
+        if (ctx->index.nlink[i] > 0) {
+            streamFile(ctx, st, inodeAt(ctx, i), ctx->fileStart[i]);
+        }
+    }
+    if (ctx->options.compactInodes) {
+        compactInodeTable(ctx);
+    }
+    return 0;
+}
+
+void releaseStream(streamState *st) {
+    free(st->source);
+    free(st->firstChild);
+    free(st->liveCount);
+    free(st->children);
+    free(st->parked);
+    free(st->memory);
+    free(st->freeMemory);
+    free(st->freeSpill);
+    if (st->spill >= 0) {
+        close(st->spill);
+    }
+}
+
+/**
+ * Streaming defragmenter: read input and write output strictly in order, so neither needs to be seekable,
+ * e.g. pipes between a backup reader and a compressor. Output is the same as defragmenter gives
+ * Metadata comes first in an image, so the whole layout is known from inode sizes before any data block
+ * is read; pointers inside indirect blocks are learnt as those arrive. Blocks arriving before their turn
+ * wait in a reorder buffer of options.streamMemory bytes, then in a temporary file under $TMPDIR
+ * Incremental option is ignored, it needs to read indirect blocks before anything is written
+ * @param inFile Input image, read once from its current position
+ * @param outFile Output image, written once from its current position
+ * @return 0 on success, 1 if input is cut short, cannot be laid out, or output cannot be written
+ */
+int streamDefragmenter(defragContext *ctx, FILE *inFile, FILE *outFile) {
+    streamState st;
+    char boot[DEFAULT_BLOCK_SIZE];
+    memset(&st, 0, sizeof(streamState));
+    st.in = inFile;
+    st.out = outFile;
+    ctx->error = ERROR_ALL_GREEN;
+    statMark(ctx);
+
+    ctx->superBlock = malloc(DEFAULT_BLOCK_SIZE);
+    if (streamRead(ctx, &st, boot, DEFAULT_BLOCK_SIZE) != 0 ||
+        streamRead(ctx, &st, ctx->superBlock, DEFAULT_BLOCK_SIZE) != 0 || !validSuperBlock(ctx->superBlock, -1)) {
+        fprintf(stderr, "Input does not start with a valid super block\n");
+        releasePlan(ctx);
+        return 1;
+    }
+    ctx->blockSize = (size_t) ctx->superBlock->size;
+    selectKernels(&ctx->kernels, ctx->blockSize, 0);
+    ctx->inodeInitial = 1024 + (off_t) ctx->superBlock->inode_offset * ctx->blockSize;
+    ctx->dataInitial = 1024 + (off_t) ctx->superBlock->data_offset * ctx->blockSize;
+    ctx->swapInitial = 1024 + (off_t) ctx->superBlock->swap_offset * ctx->blockSize;
+    ctx->copyBuffer = allocBlocks(1, ctx->blockSize);
+    ctx->inodeRegionSize = (ctx->superBlock->data_offset - ctx->superBlock->inode_offset) * ctx->blockSize;
+    ctx->inodeTable = malloc(ctx->inodeRegionSize);
+    if (streamSkip(ctx, &st, ctx->copyBuffer, ctx->inodeInitial - st.inOffset) != 0 ||
+        streamRead(ctx, &st, ctx->inodeTable, ctx->inodeRegionSize) != 0) {
+        fprintf(stderr, "Input ends inside inode region\n");
+        releasePlan(ctx);
+        return 1;
+    }
+    indexInodes(ctx); // indirect blocks are not there yet, so only sizes and links are indexed
+    statPhase(ctx, PHASE_LOAD);
+
+    if (streamLayout(ctx, &st) != 0) {
+        fprintf(stderr, "Files do not fit in data region\n");
+        ctx->error |= ERROR_DATA_BLOCK_LOST;
+        releaseStream(&st);
+        releasePlan(ctx);
+        return 1;
+    }
+    statPhase(ctx, PHASE_PLAN);
+
+    // everything up to data region, gap before inode region left zero
+    streamWrite(ctx, &st, boot, DEFAULT_BLOCK_SIZE);
+    streamWrite(ctx, &st, ctx->superBlock, DEFAULT_BLOCK_SIZE);
+    streamWrite(ctx, &st, NULL, (size_t) (ctx->inodeInitial - st.outOffset));
+    streamWrite(ctx, &st, ctx->inodeTable, ctx->inodeRegionSize);
+    statPhase(ctx, PHASE_INODES);
+
+    streamDataRegion(ctx, &st);
+    statPhase(ctx, PHASE_COPY);
+    streamFreeList(ctx, &st);
+    statPhase(ctx, PHASE_FREE_LIST);
+    streamSwapRegion(ctx, &st);
+    statPhase(ctx, PHASE_SWAP);
+    if (fflush(outFile) != 0) {
+        st.failed = 1;
+    }
+    statPhase(ctx, PHASE_SYNC);
+
+    int failed = st.failed;
+    releaseStream(&st);
+    releasePlan(ctx);
+    return failed || (ctx->error & ERROR_FATAL) != ERROR_ALL_GREEN;
+}
+
+/*********************** From there, functions are parts of file reader, verifier and extractor ***********************/
+
+#define READER_WINDOW 64 // blocks read by one pread at most while streaming a file
+
+// streams the content of files of one image, in file order, with bounded memory
+// none of the relocation state of the context is used, so it can run before and after a run, only the metadata
+// index is, when it describes this very image
+typedef struct fileReader {
+    defragContext *ctx;        /* statistics go there */
+    const metaIndex *index;    /* inodes and block lists of this image, NULL to read them from it, see indexBlocks */
+    int fd;
+    size_t blockSize;
+    blockKernels kernels;      /* picked for blockSize of this image, see selectKernels */
+    off_t inodeInitial;
+    off_t dataInitial;
+    int dataRegion;
+    size_t inodeCount;
+    char *window;              /* data blocks of the pending run */
+    int runStart;              /* first block of the pending run */
+    int runLength;             /* number of blocks in the pending run, at most READER_WINDOW */
+    size_t remain;             /* bytes of current file not delivered yet */
+    size_t offset;             /* bytes of current file delivered so far */
+    int *stack[MAX_DEPTH + 1]; /* one pointer block per indirection depth, index 0 unused */
+    void (*sink)(struct fileReader *reader, const char *data, size_t length); /* consumer of file content */
+    void *arg;                 /* state of sink */
+} fileReader;
+
+/**
+ * Byte offset of data block blk of the image, see blockOffset
+ */
+off_t readerOffset(fileReader *reader, int blk) {
+    return reader->dataInitial + (off_t) blk * reader->blockSize;
+}
+
+/**
+ * Prepare a reader over an image, buffered output of image is flushed first
+ * When the context holds the metadata index of this image with its block lists, inodes and indirect blocks
+ * are taken from there, otherwise, e.g. for an output image, they are read from the image as files are streamed
+ * @return 0 on success, -1 if the super block cannot be read or its regions do not fit in the image
+ */
+int openReader(defragContext *ctx, fileReader *reader, FILE *image) {
+    superblock super;
+    struct stat st;
+    int depth;
+    fflush(image);
+    memset(reader, 0, sizeof(fileReader));
+    reader->ctx = ctx;
+    reader->fd = fileno(image);
+    if (fstat(reader->fd, &st) != 0 ||
+        pread(reader->fd, &super, sizeof(superblock), DEFAULT_BLOCK_SIZE) != sizeof(superblock) ||
+        !validSuperBlock(&super, st.st_size)) {
+        return -1;
+    }
+    if (ctx->index.blocks != NULL && indexDescribes(ctx, reader->fd)) {
+        reader->index = &ctx->index;
+    }
+    reader->blockSize = (size_t) super.size;
+    selectKernels(&reader->kernels, reader->blockSize, 0);
+    reader->inodeInitial = 2 * DEFAULT_BLOCK_SIZE + (off_t) super.inode_offset * reader->blockSize;
+    reader->dataInitial = 2 * DEFAULT_BLOCK_SIZE + (off_t) super.data_offset * reader->blockSize;
+    reader->dataRegion = super.swap_offset - super.data_offset;
+    reader->inodeCount = (super.data_offset - super.inode_offset) * reader->blockSize / inodeSize;
+    reader->window = allocBlocks(READER_WINDOW, reader->blockSize);
+    for (depth = 1; depth <= MAX_DEPTH; depth++) {
+        reader->stack[depth] = allocBlocks(1, reader->blockSize);
+    }
+    return 0;
+}
+
+void closeReader(fileReader *reader) {
+    int depth;
+    for (depth = 1; depth <= MAX_DEPTH; depth++) {
+        free(reader->stack[depth]);
+    }
+    free(reader->window);
+}
+
+/**
+ * Read inode i of the image, from the inode region loaded with metadata index when the reader has one
+ * @return 0 on success, -1 if it cannot be read
+ */
+int readInode(fileReader *reader, size_t i, inode *node) {
+    if (reader->index != NULL) {
+        memcpy(node, inodeAt(reader->ctx, i), inodeSize);
+        return 0;
+    }
+    return pread(reader->fd, node, inodeSize, reader->inodeInitial + i * inodeSize) == inodeSize ? 0 : -1;
+}
+
+/**
+ * Hand the pending run of data blocks to the sink, a block out of data region reads as zeros
+ */
+void flushReaderRun(fileReader *reader) {
+    size_t length = reader->runLength * reader->blockSize;
+    if (reader->runLength == 0) {
+        return;
+    }
+    if (reader->runStart < 0 || reader->runStart >= reader->dataRegion ||
+        pread(reader->fd, reader->window, length, readerOffset(reader, reader->runStart)) != length) {
+        memset(reader->window, 0, length);
+    } else {
+        countIo(reader->ctx, 0, readerOffset(reader, reader->runStart), length, IO_REQUEST);
+    }
+    length = length < reader->remain ? length : reader->remain;
+    reader->sink(reader, reader->window, length);
+    reader->remain -= length;
+    reader->offset += length;
+    reader->runLength = 0;
+}
+
+/**
+ * Add a data block to the pending run, consecutive blocks are read together
+ */
+void readerBlock(fileReader *reader, int blk) {
+    if (reader->runLength > 0 && (blk != reader->runStart + reader->runLength || reader->runLength == READER_WINDOW ||
+                                  reader->runStart < 0 || reader->runStart >= reader->dataRegion)) {
+        flushReaderRun(reader);
+    }
+    if (reader->runLength == 0) {
+        reader->runStart = blk;
+    }
+    reader->runLength++;
+}
+
+/**
+ * Walk a tree of blocks in file order, as planTree does, and feed its data blocks to the reader
+ * @param blocks Number of data blocks of the file not walked yet, decreased here
+ */
+void readerTree(fileReader *reader, int blk, int depth, size_t *blocks) {
+    if (depth == 0) {
+        (*blocks)--;
+        readerBlock(reader, blk);
+        return;
+    }
+    int i;
+    int *pointers = reader->stack[depth];
+    if (blk < 0 || blk >= reader->dataRegion ||
+        pread(reader->fd, pointers, reader->blockSize, readerOffset(reader, blk)) != reader->blockSize) {
+        memset(pointers, -1, reader->blockSize);
+    } else {
+        countIo(reader->ctx, 0, readerOffset(reader, blk), reader->blockSize, IO_REQUEST);
+    }
+    for (i = 0; i < reader->kernels.fanout && *blocks > 0; i++) {
+        readerTree(reader, pointers[i], depth - 1, blocks);
+    }
+}
+
+/**
+ * Walk a tree of blocks in file order from the block list of the file in metadata index, as planTree does,
+ * and feed its data blocks to the reader, nothing but data blocks is read
+ * @param next Position of this block in the list, advanced here
+ * @param blocks Number of data blocks of the file not walked yet, decreased here
+ */
+void readerIndexedTree(fileReader *reader, size_t *next, int depth, size_t *blocks) {
+    int blk = reader->index->blocks[(*next)++];
+    if (depth == 0) {
+        (*blocks)--;
+        readerBlock(reader, blk);
+        return;
+    }
+    int i;
+    for (i = 0; i < reader->kernels.fanout && *blocks > 0; i++) {
+        readerIndexedTree(reader, next, depth - 1, blocks);
+    }
+}
+
+/**
+ * Stream the whole content of file i to the sink of reader, every indirection level included
+ * @param node Inode of the file, see readInode
+ */
+void readFile(fileReader *reader, size_t i, inode *node) {
+    int k;
+    size_t blocks = node->size > 0 ? ((size_t) node->size + reader->blockSize - 1) / reader->blockSize : 0;
+    reader->remain = node->size > 0 ? (size_t) node->size : 0;
+    reader->offset = 0;
+    if (reader->index != NULL) { // pointer fields come in the order of inodeRoots, so do trees in the list
+        size_t next = reader->index->firstBlock[i];
+        for (k = 0; k < N_DBLOCKS && blocks > 0; k++) {
+            readerIndexedTree(reader, &next, 0, &blocks);
+        }
+        for (k = 0; k < N_IBLOCKS && blocks > 0; k++) {
+            readerIndexedTree(reader, &next, 1, &blocks);
+        }
+        for (k = 2; k <= MAX_DEPTH && blocks > 0; k++) {
+            readerIndexedTree(reader, &next, k, &blocks);
+        }
+        flushReaderRun(reader);
+        return;
+    }
+    for (k = 0; k < N_DBLOCKS && blocks > 0; k++) {
+        readerTree(reader, node->dblocks[k], 0, &blocks);
+    }
+    for (k = 0; k < N_IBLOCKS && blocks > 0; k++) {
+        readerTree(reader, node->iblocks[k], 1, &blocks);
+    }
+    if (blocks > 0) {
+        readerTree(reader, node->i2block, 2, &blocks);
+    }
+    if (blocks > 0) {
+        readerTree(reader, node->i3block, 3, &blocks);
+    }
+    flushReaderRun(reader);
+}
+
+void digestSink(fileReader *reader, const char *data, size_t length) {
+    uint32_t *crc = reader->arg;
+    *crc = crc32c(*crc, data, length);
+}
+
+/**
+ * Checksum content of every live file of an image, streamed from disk with bounded memory and no temporary file
+ * @param image Image to be hashed
+ * @param count Output, number of inodes, i.e. length of the result
+ * @return Digest of every inode, allocated by malloc, NULL if the image cannot be read
+ */
+fileDigest *digestImage(defragContext *ctx, FILE *image, size_t *count) {
+    fileReader reader;
+    size_t i;
+    inode node;
+    if (openReader(ctx, &reader, image) != 0) {
+        return NULL;
+    }
+    reader.sink = digestSink;
+
+    *count = reader.inodeCount;
+    fileDigest *digests = calloc(*count + 1, sizeof(fileDigest));
+    for (i = 0; i < *count; i++) {
+        if (readInode(&reader, i, &node) != 0 || node.nlink <= 0) {
+            continue;
+        }
+        digests[i].live = 1;
+        digests[i].size = node.size;
+        reader.arg = &digests[i].crc;
+        readFile(&reader, i, &node);
+    }
+
+    closeReader(&reader);
+    return digests;
+}
+
+/**
+ * Checksum content of every live file of an input image, see digestImage
+ * Its metadata index is loaded first and stays in the context, so a run over the same image reads metadata once
+ */
+fileDigest *digestFiles(defragContext *ctx, FILE *image, size_t *count) {
+    if (loadIndex(ctx, image) != 0) {
+        return NULL;
+    }
+    indexBlocks(ctx, image);
+    return digestImage(ctx, image, count);
+}
+
+/**
+ * Digests of live inodes only, in inode order, which is where compactInodeTable moves them
+ * @param count Number of digests, updated to the number of live ones
+ * @return Digests allocated by malloc
+ */
+fileDigest *liveDigests(fileDigest *digests, size_t *count) {
+    size_t i, live = 0;
+    fileDigest *result = calloc(*count + 1, sizeof(fileDigest));
+    for (i = 0; i < *count; i++) {
+        if (digests[i].live) {
+            result[live++] = digests[i];
+        }
+    }
+    *count = live;
+    return result;
+}
+
+/**
+ * Compare every live file of an image against digests taken before defragmentation, mismatches are reported per inode
+ * With compactInodes option, the k-th live inode of the original image is compared with inode k
+ * @param image Defragmented image
+ * @param before Digests of the original image, see digestFiles
+ * @param count Number of digests in before
+ * @return Number of inodes which do not match, or -1 if the image cannot be read
+ */
+int verifier(defragContext *ctx, FILE *image, fileDigest *before, size_t count) {
+    size_t i, afterCount;
+    int mismatches = 0;
+    fileDigest *after = digestImage(ctx, image, &afterCount); // no index, output has nothing else to share it with
+    if (after == NULL || before == NULL) {
+        free(after);
+        return -1;
+    }
+    fileDigest *liveBefore = NULL;
+    if (ctx->options.compactInodes) { // inode numbers changed, only the order of live inodes is kept
+        fileDigest *liveAfter = liveDigests(after, &afterCount);
+        free(after);
+        after = liveAfter;
+        before = liveBefore = liveDigests(before, &count);
+    }
+    for (i = 0; i < count || i < afterCount; i++) {
+        fileDigest empty = {0, 0, 0};
+        fileDigest *x = i < count ? &before[i] : &empty;
+        fileDigest *y = i < afterCount ? &after[i] : &empty;
+        if (x->live != y->live || x->size != y->size || x->crc != y->crc) {
+            fprintf(stderr, "Inode %zu differs: size %d -> %d, crc32c %08x -> %08x\n",
+                    i, x->size, y->size, x->crc, y->crc);
+            mismatches++;
+        }
+    }
+    free(after);
+    free(liveBefore);
+    return mismatches;
+}
+
+// where a file being extracted goes
+typedef struct {
+    int fd;
+    int failed;
+} extractTarget;
+
+void extractSink(fileReader *reader, const char *data, size_t length) {
+    extractTarget *target = reader->arg;
+    if (pwrite(target->fd, data, length, reader->offset) != length) {
+        target->failed = 1;
+    }
+    countIo(reader->ctx, 1, reader->offset, length, IO_REQUEST);
+}
+
+// work shared by extractor threads
+typedef struct {
+    defragContext *ctx;
+    FILE *image;
+    const char *directory;
+    size_t nextInode; /* next inode to be taken by a worker */
+    size_t files;     /* files extracted */
+    size_t bytes;     /* bytes extracted */
+    int failed;       /* files which cannot be extracted */
+} extractJob;
+
+/**
+ * Worker of extractor: take the next inode, and stream its content into <directory>/file-<inode index>
+ * Size and times of the file are taken from the inode
+ */
+void *extractWorker(void *arg) {
+    extractJob *job = arg;
+    defragContext *ctx = job->ctx;
+    fileReader reader;
+    inode node;
+    size_t i;
+    if (openReader(ctx, &reader, job->image) != 0) {
+        __sync_fetch_and_add(&job->failed, 1);
+        return NULL;
+    }
+    reader.sink = extractSink;
+    char *name = malloc(strlen(job->directory) + 32);
+
+    while ((i = __sync_fetch_and_add(&job->nextInode, 1)) < reader.inodeCount) {
+        if (readInode(&reader, i, &node) != 0 || node.nlink <= 0) {
+            continue;
+        }
+        sprintf(name, "%s/file-%zu", job->directory, i);
+        extractTarget target = {open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644), 0};
+        if (target.fd < 0) {
+            __sync_fetch_and_add(&job->failed, 1);
+            continue;
+        }
+        reader.arg = &target;
+        readFile(&reader, i, &node);
+
+        // a file whose tail is missing still gets its full size, times go last as writing changes them
+        struct timespec times[2] = {{node.atime, 0}, {node.mtime, 0}};
+        if (ftruncate(target.fd, node.size > 0 ? node.size : 0) != 0 || futimens(target.fd, times) != 0) {
+            target.failed = 1;
+        }
+        close(target.fd);
+        if (target.failed) {
+            __sync_fetch_and_add(&job->failed, 1);
+        } else {
+            __sync_fetch_and_add(&job->files, 1);
+            __sync_fetch_and_add(&job->bytes, (size_t) reader.offset);
+        }
+    }
+
+    free(name);
+    closeReader(&reader);
+    return NULL;
+}
+
+/**
+ * Unpack every live file of an image into a directory, one file per inode named file-<inode index>
+ * Files are streamed with pread by several threads at once, every indirection level is supported
+ * Inodes and indirect blocks come from metadata index, loaded first unless printFiles already did
+ * @param directory Destination, created if it does not exist
+ * @param threads Number of worker threads
+ * @return Number of files which cannot be extracted, -1 if directory or image cannot be read or no worker starts
+ */
+int extractor(defragContext *ctx, FILE *image, const char *directory, int threads) {
+    extractJob job = {ctx, image, directory, 0, 0, 0, 0};
+    int i;
+    if (mkdir(directory, S_IRWXU) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    if (loadIndex(ctx, image) != 0) {
+        return -1;
+    }
+    indexBlocks(ctx, image); // workers share it, nothing but file content is read while they stream
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    int started = 0; // files are taken one at a time, so the workers that did start extract every one
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, extractWorker, &job) == 0) {
+            started++;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (started == 0) {
+        fprintf(stderr, "Cannot start any extract worker\n");
+        return -1;
+    }
+
+    printf("Extracted %zu files (%zu bytes) into %s\n", job.files, job.bytes, directory);
+    return job.failed;
+}
+
+/*********************** From there, functions are parts of block ownership checker ***********************/
+
+#define OWNER_NONE     0  /* neither used nor free, i.e. leaked */
+#define OWNER_FREE     -1 /* on the free list */
+#define REPORT_LIMIT   10 /* detailed lines printed per kind of problem */
+#define LINK_UNREADABLE (-2) /* next pointer of a free block lying beyond the end of image */
+
+// what the checker found, kinds are counted separately
+typedef struct {
+    size_t outOfRange;  /* pointers out of data region */
+    size_t crossLinked; /* blocks referenced more than once */
+    size_t usedFree;    /* blocks both referenced and on the free list */
+    size_t leaked;      /* blocks neither referenced nor free */
+    size_t badFreeList; /* free list entries out of range or looping back */
+} checkReport;
+
+/**
+ * Take block blk for inode owner, owner is inode index plus one
+ */
+void claimBlock(int *owners, int dataRegion, int blk, int owner, checkReport *report) {
+    if (blk < 0 || blk >= dataRegion) {
+        if (report->outOfRange++ < REPORT_LIMIT) {
+            printf("Inode %d: pointer %d out of data region\n", owner - 1, blk);
+        }
+        return;
+    }
+    if (owners[blk] != OWNER_NONE) {
+        if (report->crossLinked++ < REPORT_LIMIT) {
+            printf("Block %d: cross-linked between inodes %d and %d\n", blk, owners[blk] - 1, owner - 1);
+        }
+        return;
+    }
+    owners[blk] = owner;
+}
+
+/**
+ * Claim a tree of blocks for an inode in file order, as planTree walks it, data blocks are never read
+ * @param blocks Number of data blocks of the file not walked yet, decreased here
+ */
+void claimTree(fileReader *reader, int *owners, int blk, int depth, size_t *blocks, int owner, checkReport *report) {
+    int i;
+    int valid = blk >= 0 && blk < reader->dataRegion && owners[blk] == OWNER_NONE;
+    claimBlock(owners, reader->dataRegion, blk, owner, report);
+    if (depth == 0) {
+        (*blocks)--;
+        return;
+    }
+    int *pointers = reader->stack[depth];
+    if (!valid || pread(reader->fd, pointers, reader->blockSize,
+                        readerOffset(reader, blk)) != reader->blockSize) {
+        // nothing below a bad indirect block can be trusted, its data blocks are counted as walked
+        size_t below = 1;
+        for (i = 0; i < depth; i++) {
+            below *= reader->kernels.fanout;
+        }
+        *blocks -= below < *blocks ? below : *blocks;
+        return;
+    }
+    countIo(reader->ctx, 0, readerOffset(reader, blk), reader->blockSize, IO_REQUEST);
+    for (i = 0; i < reader->kernels.fanout && *blocks > 0; i++) {
+        claimTree(reader, owners, pointers[i], depth - 1, blocks, owner, report);
+    }
+}
+
+/**
+ * Read the next pointer of every block no file owns, in one ascending sweep of the data region
+ * Chasing the free list block by block costs a random read per free block, which on an image with
+ * tens of millions of free blocks is far slower than reading the whole data region once
+ * @return Next pointer of every block, only valid where owners is OWNER_NONE, LINK_UNREADABLE if it cannot be read
+ */
+int *gatherLinks(defragContext *ctx, fileReader *reader, int *owners) {
+    int *links = malloc(sizeof(int) * (reader->dataRegion + 1));
+    int blk, k, n;
+    for (blk = 0; blk < reader->dataRegion; blk += n) {
+        n = reader->dataRegion - blk < READER_WINDOW ? reader->dataRegion - blk : READER_WINDOW;
+        for (k = 0; k < n && owners[blk + k] != OWNER_NONE; k++);
+        if (k == n) { // every block of the window belongs to a file
+            continue;
+        }
+        size_t length = n * reader->blockSize;
+        int readable = pread(reader->fd, reader->window, length, readerOffset(reader, blk)) == length;
+        if (readable) {
+            countIo(ctx, 0, readerOffset(reader, blk), length, IO_REQUEST);
+        }
+        for (k = 0; k < n; k++) {
+            links[blk + k] = readable ? *(int *) (reader->window + k * reader->blockSize) : LINK_UNREADABLE;
+        }
+    }
+    return links;
+}
+
+/**
+ * Check that every data block has exactly one owner: a single live file, or the free list
+ * Inode table, indirect trees and free list are each walked once, so it runs in O(blocks)
+ * With repair, the free list is rebuilt in ascending order from every block no file references,
+ * which fixes leaked blocks, blocks both used and free, and broken lists; a pointer out of range
+ * or a cross-linked block cannot be repaired here, as the content of a file is missing or shared
+ * @param image Image to check, must be opened for update to repair
+ * @param repair Non-zero to rebuild the free list when it is inconsistent
+ * @return ERROR_ALL_GREEN if consistent, ERROR_DATA_BLOCK_LOST for a file problem,
+ *         ERROR_CORRUPTED_FREE_DATA for a free space problem, left unrepaired
+ */
+int checker(defragContext *ctx, FILE *image, int repair) {
+    fileReader reader;
+    checkReport report;
+    inode node;
+    size_t i, files = 0;
+    int k, blk, result = ERROR_ALL_GREEN;
+    superblock super;
+    if (openReader(ctx, &reader, image) != 0 ||
+        pread(reader.fd, &super, sizeof(superblock), DEFAULT_BLOCK_SIZE) != sizeof(superblock)) {
+        return ERROR_DATA_BLOCK_LOST;
+    }
+    memset(&report, 0, sizeof(checkReport));
+    int *owners = calloc(reader.dataRegion + 1, sizeof(int));
+
+    for (i = 0; i < reader.inodeCount; i++) {
+        if (readInode(&reader, i, &node) != 0 || node.nlink <= 0) {
+            continue;
+        }
+        files++;
+        size_t blocks = node.size > 0 ? ((size_t) node.size + reader.blockSize - 1) / reader.blockSize : 0;
+        for (k = 0; k < N_DBLOCKS && blocks > 0; k++) {
+            claimTree(&reader, owners, node.dblocks[k], 0, &blocks, (int) i + 1, &report);
+        }
+        for (k = 0; k < N_IBLOCKS && blocks > 0; k++) {
+            claimTree(&reader, owners, node.iblocks[k], 1, &blocks, (int) i + 1, &report);
+        }
+        if (blocks > 0) {
+            claimTree(&reader, owners, node.i2block, 2, &blocks, (int) i + 1, &report);
+        }
+        if (blocks > 0) {
+            claimTree(&reader, owners, node.i3block, 3, &blocks, (int) i + 1, &report);
+        }
+    }
+
+    // free list, a block seen twice means the list loops, blocks of files it strays into are marked in strayed
+    int *links = gatherLinks(ctx, &reader, owners);
+    char *strayed = calloc(reader.dataRegion + 1, 1);
+    for (blk = super.free_iblock; blk >= 0; ) {
+        if (blk >= reader.dataRegion || owners[blk] == OWNER_FREE || strayed[blk]) {
+            if (report.badFreeList++ < REPORT_LIMIT) {
+                printf("Free list: entry %d %s\n", blk, blk >= reader.dataRegion ? "out of data region" : "loops back");
+            }
+            break;
+        }
+        int next = links[blk];
+        if (owners[blk] != OWNER_NONE) { // not gathered, the list strays into a file
+            if (report.usedFree++ < REPORT_LIMIT) {
+                printf("Block %d: on free list but used by inode %d\n", blk, owners[blk] - 1);
+            }
+            strayed[blk] = 1;
+            if (pread(reader.fd, &next, sizeof(int), readerOffset(&reader, blk)) != sizeof(int)) {
+                next = LINK_UNREADABLE;
+            } else {
+                countIo(ctx, 0, readerOffset(&reader, blk), sizeof(int), IO_REQUEST);
+            }
+        } else {
+            owners[blk] = OWNER_FREE;
+        }
+        if (next == LINK_UNREADABLE) {
+            report.badFreeList++;
+            break;
+        }
+        blk = next;
+    }
+    free(strayed);
+    free(links);
+    for (blk = 0; blk < reader.dataRegion; blk++) {
+        if (owners[blk] == OWNER_NONE && report.leaked++ < REPORT_LIMIT) {
+            printf("Block %d: neither used nor free\n", blk);
+        }
+    }
+
+    printf("Checked %zu files over %d blocks: %zu out of range, %zu cross-linked, %zu used and free, "
+           "%zu leaked, %zu free list errors\n", files, reader.dataRegion, report.outOfRange, report.crossLinked,
+           report.usedFree, report.leaked, report.badFreeList);
+
+    if (report.outOfRange > 0 || report.crossLinked > 0) {
+        result |= ERROR_DATA_BLOCK_LOST;
+    }
+    if (report.usedFree > 0 || report.leaked > 0 || report.badFreeList > 0) {
+        if (repair) { // link every block no file references, in ascending order, from the super block
+            int next = -1, written = 1;
+            for (blk = reader.dataRegion - 1; blk >= 0 && written; blk--) {
+                if (owners[blk] <= OWNER_NONE) {
+                    written = pwrite(reader.fd, &next, sizeof(int), readerOffset(&reader, blk)) == sizeof(int);
+                    countIo(ctx, 1, readerOffset(&reader, blk), sizeof(int), IO_REQUEST);
+                    next = blk;
+                }
+            }
+            written = written && pwrite(reader.fd, &next, sizeof(int),
+                                        DEFAULT_BLOCK_SIZE + offsetof(superblock, free_iblock)) == sizeof(int);
+            if (written && fsync(reader.fd) == 0) {
+                printf("Free list rebuilt from %d\n", next);
+            } else { // the image may be left half linked, so the damage still stands
+                perror("Cannot rebuild free list");
+                result |= ERROR_CORRUPTED_FREE_DATA;
+            }
+        } else {
+            result |= ERROR_CORRUPTED_FREE_DATA;
+        }
+    }
 
-    return (d_error == ERROR_ALL_GREEN);
+    free(owners);
+    closeReader(&reader);
+    return result;
 }
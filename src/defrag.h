@@ -1,16 +1,70 @@
 #ifndef P5_DEFRAG_H
 #define P5_DEFRAG_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
-extern int d_error;
+// error flags of a run, combined with bitwise or, see contextError
 #define ERROR_ALL_GREEN             0
 #define ERROR_DATA_BLOCK_LOST       1
 #define ERROR_CORRUPTED_FREE_DATA   2
 #define ERROR_CORRUPTED_SWAP_REGION 4
+// errors the output image cannot recover from, the others are remedied and only reported
+#define ERROR_FATAL                 (ERROR_DATA_BLOCK_LOST | ERROR_CORRUPTED_SWAP_REGION)
+
+// block transfer engines, see defragOptions
+#define ENGINE_STDIO                0 /* fseek + fread/fwrite through FILE pointers */
+#define ENGINE_MMAP                 1 /* memcpy between memory-mapped input and output */
+#define ENGINE_URING                2 /* batched asynchronous pread/pwrite through io_uring */
+
+// orders files are laid out in, see defragOptions
+#define LAYOUT_INODE                0 /* inode index order */
+#define LAYOUT_HOT                  1 /* most recently accessed or modified first, by max(atime, mtime) */
+#define LAYOUT_SMALL                2 /* smallest first */
+#define LAYOUT_OWNER                3 /* grouped by uid, then by gid */
+
+// how a run goes, start from defaultOptions and change what is needed before createContext
+typedef struct {
+    int engine;        /* block transfer engine, one of ENGINE_* */
+    int threads;       /* worker threads copying files concurrently, 1 keeps the source-ordered single pass */
+    int incremental;   /* non-zero to keep contiguous files in place and move only fragmented ones into free gaps */
+    int layout;        /* file order, one of LAYOUT_* */
+    int indirectFirst; /* non-zero to put all indirect blocks of a file ahead of its data blocks */
+    int sparse;        /* non-zero to leave zero blocks of output image as holes and copy untouched spans
+                          with copy_file_range, ignored by defragmentInPlace */
+    int compactInodes; /* non-zero to move live inodes to the front of inode region and rebuild a sorted
+                          free inode list, files then get new inode numbers */
+    int verbose;       /* non-zero to print super block and other details while running */
+    size_t streamMemory; /* bytes of blocks streamDefragmenter holds in memory while they wait for their turn,
+                            later ones wait in a temporary file */
+} defragOptions;
+
+// run statistics, filled by every defragmenter, applyPatch and the verifier, see printStats
+#define PHASE_LOAD                  0 /* super block and inode region */
+#define PHASE_PLAN                  1 /* relocation plan, or layout of in-place moves */
+#define PHASE_COPY                  2 /* data and indirect blocks, or in-place moves */
+#define PHASE_INODES                3 /* updated inode region */
+#define PHASE_FREE_LIST             4 /* data free list */
+#define PHASE_SWAP                  5 /* super block and swap region */
+#define PHASE_SYNC                  6 /* flushing mapped output */
+#define PHASE_JOURNAL               7 /* in-place journal */
+#define PHASE_FINISH                8 /* in-place inode region, free list and super block */
+#define PHASE_VERIFY                9 /* digests of input and output */
+#define PHASE_COUNT                 10
+#define SEEK_BUCKETS                32 /* bucket i counts seeks of [2^i, 2^(i+1)) KiB, bucket 0 also shorter ones */
+
+typedef struct {
+    double seconds[PHASE_COUNT];        /* wall time of every phase */
+    size_t requests;                    /* read, write and copy calls issued, transfers on mapped images excluded */
+    size_t seeks;                       /* requests not starting where the previous one in same direction ended */
+    size_t bytesRead;
+    size_t bytesWritten;
+    size_t bytesSpilled;                /* blocks streamDefragmenter parked in its temporary file */
+    size_t seekHistogram[SEEK_BUCKETS]; /* seek distances */
+} runStats;
 
 #define DEFAULT_BLOCK_SIZE          512
 typedef struct {
@@ -47,10 +101,94 @@ typedef struct {
     int i3block;            /* pointer to triply indirect block */
 } inode;
 
-int defragmenter(FILE* inFile, FILE* outFile);
+// header of the relocation map defragmenter keeps next to its output, followed by
+//   int relocation[dataRegion]           new index of every input data block, -1 if no file uses it
+//   unsigned short pointerCount[dataRegion] live pointers of every indirect block, 0 for a data block
+//   char used[dataRegion]                1 for every output block taken by a file
+//   inode region of output, as planned
+#define MAP_MAGIC "AFSMAP01"
+typedef struct {
+    char magic[8];
+    superblock super;   /* super block of input image */
+    uint32_t inodeCrc;  /* CRC32C of input inode region, a map of another image or version is never resumed */
+    int layout;         /* options the plan was made with, see defragOptions */
+    int indirectFirst;
+    int incremental;
+    int dataRegion;     /* entries of every array above */
+    int dataBlockIndex; /* first output block past every file */
+    int copied;         /* input blocks below this one are durable in output, dataRegion once copy pass is over */
+} relocationMap;
+
+// header of a patch, see patchDefragmenter and applyPatch, followed by extents in ascending offset order, each one
+//   patchRecord | length bytes of new content
+// extents never overlap, and a record of length 0 closes the patch
+#define PATCH_MAGIC "AFSPAT01"
+typedef struct {
+    char magic[8];
+    int64_t imageSize; /* size of the image the patch was made from, and applies to */
+    int blockSize;     /* block size of that image */
+} patchHeader;
+
+typedef struct {
+    int64_t offset;  /* byte offset of the extent in image, image size for the closing record */
+    uint32_t length; /* bytes of new content following the record */
+    uint32_t oldCrc; /* CRC32C of the bytes the extent replaces */
+    uint32_t newCrc; /* CRC32C of the bytes following the record */
+} patchRecord;
+
+// content digest of one inode, see digestFiles
+typedef struct {
+    int live;     /* non-zero if the inode is in use */
+    int size;     /* file size in bytes */
+    uint32_t crc; /* CRC32C of file content */
+} fileDigest;
+
+/**
+ * Every function below works on a context, which holds all the state of one image: options, layout of
+ * the image, relocation plan, statistics and error flags. Nothing is shared between contexts, so
+ * several images can be handled at once by different threads, one context each. A context is reused
+ * for the runs over one image, e.g. digestFiles, defragmenter then verifier, but never by two threads at once.
+ */
+typedef struct defragContext defragContext;
+
+void defaultOptions(defragOptions* options);
+
+defragContext* createContext(const defragOptions* options);
+
+void destroyContext(defragContext* ctx);
+
+int contextError(const defragContext* ctx);
+
+const runStats* contextStats(const defragContext* ctx);
+
+int defragmenter(defragContext* ctx, FILE* inFile, FILE* outFile, const char* mapName);
+
+int defragmentInPlace(defragContext* ctx, FILE* image, const char* journalName);
+
+int streamDefragmenter(defragContext* ctx, FILE* inFile, FILE* outFile);
+
+int patchDefragmenter(defragContext* ctx, FILE* inFile, FILE* patchFile);
+
+int applyPatch(defragContext* ctx, FILE* patchFile, FILE* image);
+
+int analyzer(defragContext* ctx, FILE* inFile, int perFile);
+
+fileDigest* digestFiles(defragContext* ctx, FILE* image, size_t* count);
+
+int verifier(defragContext* ctx, FILE* image, fileDigest* before, size_t count);
+
+void statMark(defragContext* ctx);
+
+void statPhase(defragContext* ctx, int phase);
+
+void printStats(defragContext* ctx, FILE* out);
+
+int checker(defragContext* ctx, FILE* image, int repair);
+
+int extractor(defragContext* ctx, FILE* image, const char* directory, int threads);
 
-void validator(FILE* inFile);
+void validator(defragContext* ctx, FILE* inFile);
 
-void printFiles(FILE* inFile);
+void printFiles(defragContext* ctx, FILE* inFile);
 
 #endif //P5_DEFRAG_H
@@ -1,3 +1,8 @@
+#include <ctype.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "defrag.h"
 
@@ -26,22 +31,264 @@ char* generateFileName(char* src) {
     return dst;
 }
 
+char* statsName = NULL; // where run statistics go, NULL if not wanted
+char* emitMapName = NULL; // where the relocation map is kept, NULL to remove it after a successful run
+char* patchName = NULL;   // where --patch writes what a run changes, NULL for a full output image
+char* applyName = NULL;   // patch --apply writes into the image
+
+#define CHECK_NONE   0 /* run without checking */
+#define CHECK_BEFORE 1 /* check block ownership before a run, see precheck */
+#define CHECK_ONLY   2 /* report inconsistencies, nothing else */
+#define CHECK_REPAIR 3 /* report and repair what can be repaired, nothing else */
+
+// selected mode, see runImage
+int analyzeMode = 0;
+int inPlaceMode = 0;
+int streamMode = 0;             // stdin to stdout, see stream
+int verifyMode = 1;
+int checkpointMode = 1;         // keep a relocation map next to the output, so an interrupted run resumes
+int checkMode = CHECK_BEFORE;
+int jobs = 0;                   // threads given by -j, 0 if not given
+char* extractDirectory = NULL;
+
+defragOptions options;          // options every image runs with
+defragContext* context = NULL;  // state of the image being handled, see runImage
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * Write run statistics as JSON into the file given by --stats, "-" meaning stdout, or stderr when streaming
+ */
+void writeStats() {
+    if (statsName == NULL) {
+        return;
+    }
+    FILE* console = streamMode ? stderr : stdout;
+    FILE* out = strcmp(statsName, "-") == 0 ? console : fopen(statsName, "w");
+    if (out == NULL) {
+        perror("Cannot write statistics");
+        return;
+    }
+    printStats(context, out);
+    if (out != console) {
+        fclose(out);
+    }
+}
+
 void validation(FILE* inFile) {
     printf("Validating file...\n");
-    printFiles(inFile);
-    validator(inFile);
+    printFiles(context, inFile);
+    validator(context, inFile);
     fclose(inFile);
     exit(0);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        perror("Usage: defrag data-file");
+void usage() {
+    fprintf(stderr, "Usage: defrag [options] data-file...\n");
+    fprintf(stderr, "       defrag --stream[=MB] [options] < data-file > output-file\n");
+    fprintf(stderr, "Several data files, or --manifest, run them as a batch, each one in its own process\n");
+    fprintf(stderr, "  -m, --mmap          move blocks between memory-mapped images instead of stdio\n");
+    fprintf(stderr, "  -u, --uring         keep many block transfers in flight with io_uring\n");
+    fprintf(stderr, "  -a, --analyze       report fragmentation only, nothing is written (twice for per-file lines)\n");
+    fprintf(stderr, "  -x, --extract DIR   unpack every file into DIR, in parallel (-j, all CPUs by default)\n");
+    fprintf(stderr, "  -i, --in-place      permute blocks inside data-file, no second image is written\n");
+    fprintf(stderr, "  -I, --incremental   only move fragmented files, best combined with -i\n");
+    fprintf(stderr, "  -j, --jobs N        copy files with N threads using pread/pwrite\n");
+    fprintf(stderr, "  -L, --layout POLICY file order: inode, hot, small or owner, add ,indirect-first\n"
+                    "                      to put indirect blocks ahead of data, e.g. -L hot,indirect-first\n");
+    fprintf(stderr, "  -s, --sparse        leave zero blocks as holes, copy untouched spans inside the kernel\n");
+    fprintf(stderr, "  -c, --compact-inodes\n"
+                    "                      move live inodes to the front of inode region, files get new numbers\n");
+    fprintf(stderr, "      --stream[=MB]   read stdin and write stdout strictly in order, blocks arriving early\n"
+                    "                      wait in MB of memory (64 by default), then in a file under $TMPDIR\n");
+    fprintf(stderr, "      --patch FILE    write only what the run changes into FILE, instead of an output image\n");
+    fprintf(stderr, "      --apply FILE    write a patch made by --patch into data-file, once it matches every extent\n");
+    fprintf(stderr, "      --stats FILE    write per-phase timing and I/O counters as JSON, - for stdout\n");
+    fprintf(stderr, "      --manifest FILE batch over data files listed in FILE, one per line, - for stdin\n");
+    fprintf(stderr, "  -P, --parallel N    images defragmented at once in a batch (CPUs / -j by default)\n");
+    fprintf(stderr, "  -v, --verbose       print super block details\n");
+    fprintf(stderr, "      --check         report blocks used twice, used and free, or neither, nothing else\n");
+    fprintf(stderr, "      --repair        same as --check, and rebuild a broken free list in place\n");
+    fprintf(stderr, "      --no-check      skip the check every run starts with\n");
+    fprintf(stderr, "      --emit-map FILE keep the relocation map in FILE, see README for its format\n");
+    fprintf(stderr, "      --no-checkpoint start over after an interruption, no relocation map is kept\n");
+    fprintf(stderr, "      --verify        compare CRC32C of every file before and after the run (default)\n");
+    fprintf(stderr, "      --no-verify     skip the comparison\n");
+    exit(1);
+}
+
+/**
+ * Select layout policy from a comma separated list, see usage
+ * @return 0 on success, -1 if a name is unknown
+ */
+int parseLayout(char* spec) {
+    char* name;
+    for (name = strtok(spec, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (strcmp(name, "inode") == 0) {
+            options.layout = LAYOUT_INODE;
+        } else if (strcmp(name, "hot") == 0) {
+            options.layout = LAYOUT_HOT;
+        } else if (strcmp(name, "small") == 0) {
+            options.layout = LAYOUT_SMALL;
+        } else if (strcmp(name, "owner") == 0) {
+            options.layout = LAYOUT_OWNER;
+        } else if (strcmp(name, "indirect-first") == 0) {
+            options.indirectFirst = 1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Report fragmentation of the image without writing anything
+ */
+int analyze(char* name, int perFile) {
+    FILE* inFile = fopen(name, "r");
+    if (inFile == NULL) {
+        perror("Input file not exists.");
+        exit(1);
+    }
+
+    int result = analyzer(context, inFile, perFile);
+    fclose(inFile);
+    return result;
+}
+
+/**
+ * Check block ownership before a run, a run over an image whose files are broken is refused
+ * Free space problems are only reported, every run rebuilds the free list anyway
+ */
+void precheck(FILE* image) {
+    if (checkMode != CHECK_BEFORE) {
+        return;
+    }
+    statMark(context);
+    int result = checker(context, image, 0);
+    statPhase(context, PHASE_VERIFY);
+    if (result & ERROR_DATA_BLOCK_LOST) {
+        fprintf(stderr, "Image has pointers out of range or cross-linked blocks, refused (see --check, --no-check).\n");
         exit(1);
     }
+}
 
+/**
+ * Check block ownership of the image, and repair it if asked to
+ * @return 0 if the image is consistent, or has been repaired
+ */
+int check(char* name) {
+    FILE* image = fopen(name, checkMode == CHECK_REPAIR ? "r+" : "r");
+    if (image == NULL) {
+        perror("Input file not exists.");
+        exit(1);
+    }
+
+    int result = checker(context, image, checkMode == CHECK_REPAIR);
+    fclose(image);
+    return result != ERROR_ALL_GREEN;
+}
+
+/**
+ * Take digests of the image before a run, see verify
+ * @return NULL if verification is off
+ */
+fileDigest* digest(FILE* image, size_t* count, int verifyMode) {
+    if (!verifyMode) {
+        return NULL;
+    }
+    statMark(context);
+    fileDigest* digests = digestFiles(context, image, count);
+    statPhase(context, PHASE_VERIFY);
+    return digests;
+}
+
+/**
+ * Check the result of a run against digests taken before it, exit if any file differs
+ * @param before Digests of the original image, NULL to skip the check
+ */
+void verify(FILE* image, fileDigest* before, size_t count) {
+    if (before == NULL) {
+        return;
+    }
+    statMark(context);
+    int mismatches = verifier(context, image, before, count);
+    statPhase(context, PHASE_VERIFY);
+    free(before);
+    if (mismatches != 0) {
+        fprintf(stderr, "Verification failed: %d file(s) differ from the input image.\n", mismatches);
+        exit(1);
+    }
+    printf("Verified: every file matches the input image.\n");
+}
+
+/**
+ * Unpack every live file of the image into a directory, nothing is written to the image
+ */
+int extract(char* name, char* directory, int threads) {
+    FILE* image = fopen(name, "r");
+    if (image == NULL) {
+        perror("Input file not exists.");
+        exit(1);
+    }
+
+    int failed = extractor(context, image, directory, threads);
+    fclose(image);
+    if (failed != 0) {
+        perror("Cannot extract every file");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Defragment the image in place, journal is kept at <data-file>.journal
+ * Running it again after an interruption recovers and completes the previous run,
+ * there is no original image left to verify against in that case
+ */
+int inPlace(char* name, int verifyMode) {
+    FILE* image = fopen(name, "r+");
+    if (image == NULL) {
+        perror("Input file not exists.");
+        exit(1);
+    }
+
+    char* journalName = malloc(strlen(name) + strlen(".journal") + 1);
+    strcpy(journalName, name);
+    strcat(journalName, ".journal");
+    size_t digestCount = 0;
+    int recovering = access(journalName, F_OK) == 0;
+    if (!recovering) {
+        precheck(image);
+    }
+    fileDigest* digests = digest(image, &digestCount, verifyMode && !recovering);
+    if (defragmentInPlace(context, image, journalName) != 0) {
+        perror("Cannot defrag input file in place, this file may be corrupted.");
+        exit(1);
+    }
+    verify(image, digests, digestCount);
+    writeStats();
+
+    printf("Defragmentation Succeed!\n");
+    printf("Image defragmented in place: %s\n", name);
+    free(journalName);
+    fclose(image);
+    return 0;
+}
+
+/**
+ * Defragment the image into <data-file>-defrag, see generateFileName
+ * Its relocation map is kept at <data-file>-defrag.map during the run, or in the file given by --emit-map:
+ * if the run is interrupted, running the same command again resumes it from its last checkpoint
+ * A -j run keeps no map unless --emit-map asks for one, it is only written once the copy is over
+ */
+int defragment(char* inName) {
     FILE* inFile;
-    inFile = fopen(argv[1], "r");
+    inFile = fopen(inName, "r");
     if (inFile == NULL) {
         perror("Input file not exists.");
         exit(1);
@@ -49,23 +296,423 @@ int main(int argc, char* argv[]) {
 
     //validation(inFile);
 
-    FILE* outFile;
-    char *outName = generateFileName(argv[1]);
-    outFile = fopen(outName, "w+");
+    FILE* outFile = NULL;
+    char *outName = generateFileName(inName);
+    char *mapName = NULL;
+    if (emitMapName != NULL) {
+        mapName = strdup(emitMapName);
+    } else if (checkpointMode && options.threads > 1) { // files are planned as they are copied, nothing to resume
+        fprintf(stderr, "Warning: -j runs keep no checkpoint, an interrupted run starts over.\n");
+    } else if (checkpointMode) {
+        mapName = malloc(strlen(outName) + strlen(".map") + 1);
+        strcpy(mapName, outName);
+        strcat(mapName, ".map");
+    }
+    if (mapName != NULL && access(mapName, F_OK) == 0) { // resumed over what is already written
+        outFile = fopen(outName, "r+");
+        if (outFile == NULL) { // output is gone, so is the progress the map tells
+            remove(mapName);
+        }
+    }
+    if (outFile == NULL) {
+        outFile = fopen(outName, "w+");
+    }
     if (outFile == NULL) {
         perror("Cannot create output file.");
         exit(1);
     }
 
-    if (defragmenter(inFile, outFile) != 0) {
+    size_t digestCount = 0;
+    precheck(inFile);
+    fileDigest* digests = digest(inFile, &digestCount, verifyMode);
+    if (defragmenter(context, inFile, outFile, mapName) != 0) {
         perror("Cannot defrag input file, this file may be corrupted.");
         exit(1);
     }
+    if (contextError(context) != ERROR_ALL_GREEN) {
+        fprintf(stderr, "Warning: input image is inconsistent (error %d), output has been mended.\n",
+                contextError(context));
+    }
+    verify(outFile, digests, digestCount);
+    writeStats();
 
 	printf("Defragmentation Succeed!\n");
 	printf("Output file name: %s\n", outName);
+    if (mapName != NULL && emitMapName == NULL) {
+        remove(mapName);
+    }
+    free(mapName);
     free(outName);
     fclose(inFile);
     fclose(outFile);
     return 0;
 }
+
+/**
+ * Defragment the image into a patch holding only what the run changes, see patchDefragmenter
+ * Files are not verified since no output image exists, run --check on the image once patched
+ */
+int patch(char* name) {
+    FILE* inFile = fopen(name, "r");
+    if (inFile == NULL) {
+        perror("Input file not exists.");
+        exit(1);
+    }
+    FILE* patchFile = fopen(patchName, "w");
+    if (patchFile == NULL) {
+        perror("Cannot create patch file.");
+        exit(1);
+    }
+
+    precheck(inFile);
+    if (patchDefragmenter(context, inFile, patchFile) != 0) {
+        fprintf(stderr, "Cannot make a patch of input file, this file may be corrupted.\n");
+        fclose(patchFile);
+        remove(patchName);
+        exit(1);
+    }
+    if (contextError(context) != ERROR_ALL_GREEN) {
+        fprintf(stderr, "Warning: input image is inconsistent (error %d), patch mends it.\n", contextError(context));
+    }
+    writeStats();
+
+    printf("Patch file name: %s\n", patchName);
+    fclose(inFile);
+    fclose(patchFile);
+    return 0;
+}
+
+/**
+ * Write a patch made by --patch into the image, e.g. the device an image lives on
+ * A patch of another image is refused before anything is written; an interrupted apply can be run again
+ */
+int apply(char* name) {
+    FILE* image = fopen(name, "r+");
+    if (image == NULL) {
+        perror("Input file not exists.");
+        exit(1);
+    }
+    FILE* patchFile = fopen(applyName, "r");
+    if (patchFile == NULL) {
+        perror("Cannot open patch file.");
+        exit(1);
+    }
+
+    int result = applyPatch(context, patchFile, image);
+    if (result == 1) {
+        fprintf(stderr, "Patch not applied, image is untouched.\n");
+        exit(1);
+    } else if (result != 0) {
+        fprintf(stderr, "Patch applied partially, run the same command again to complete it.\n");
+        exit(1);
+    }
+    writeStats();
+
+    printf("Image patched: %s\n", name);
+    fclose(patchFile);
+    fclose(image);
+    return 0;
+}
+
+/**
+ * Defragment the image streamed on stdin into stdout, e.g. between a backup reader and a compressor
+ * Nothing is checked nor verified since neither side can be read twice, run --check on the result instead
+ * Messages go to stderr, stdout carries the image
+ */
+int stream() {
+    setvbuf(stdin, NULL, _IOFBF, 1 << 20);
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    if (streamDefragmenter(context, stdin, stdout) != 0) {
+        fprintf(stderr, "Cannot defrag input stream, output is incomplete.\n");
+        exit(1);
+    }
+    if (contextError(context) != ERROR_ALL_GREEN) {
+        fprintf(stderr, "Warning: input image is inconsistent (error %d), output has been mended.\n",
+                contextError(context));
+    }
+    writeStats();
+    return 0;
+}
+
+/**
+ * Run the selected mode on one image
+ * @return Exit status of the run, 0 on success
+ */
+int runImage(char* name) {
+    int result;
+    context = createContext(&options);
+    if (checkMode >= CHECK_ONLY) {
+        result = check(name);
+    } else if (analyzeMode) {
+        result = analyze(name, analyzeMode > 1);
+    } else if (extractDirectory != NULL) {
+        result = extract(name, extractDirectory, jobs > 0 ? jobs : (int) sysconf(_SC_NPROCESSORS_ONLN));
+    } else if (streamMode) {
+        result = stream();
+    } else if (applyName != NULL) {
+        result = apply(name);
+    } else if (patchName != NULL) {
+        result = patch(name);
+    } else if (inPlaceMode) {
+        result = inPlace(name, verifyMode);
+    } else {
+        result = defragment(name);
+    }
+    destroyContext(context);
+    context = NULL;
+    return result;
+}
+
+/**
+ * Append image paths listed in a manifest, one per line, blank lines and lines starting with # are skipped
+ * @param name Manifest file, - for stdin
+ * @param names Paths collected so far, grown with realloc
+ * @param count Number of paths in names
+ * @return Number of paths in names, -1 if manifest cannot be read
+ */
+int readManifest(char* name, char*** names, int count) {
+    FILE* manifest = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+    if (manifest == NULL) {
+        return -1;
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, manifest)) >= 0) {
+        while (length > 0 && isspace((unsigned char) line[length - 1])) {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        *names = realloc(*names, sizeof(char*) * (count + 2));
+        (*names)[count++] = strdup(line);
+    }
+    free(line);
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+    return count;
+}
+
+/**
+ * Batch mode: run the selected mode over many images, each one in a child process, parallel at a time
+ * A run exits as soon as something goes wrong, so a process per image is what keeps a failure to its own image
+ * A line is reported as each image completes, then a summary
+ * @return 0 if every image succeeded, 1 otherwise
+ */
+int batch(char** names, int count, int parallel) {
+    pid_t* pids = calloc(count, sizeof(pid_t));
+    double* started = calloc(count, sizeof(double));
+    int next = 0, running = 0, done = 0, failed = 0;
+    double batchStart = now(), busy = 0;
+    long peakKb = 0;
+
+    printf("%-40s %-6s %10s %10s\n", "image", "result", "seconds", "peak KB");
+    while (done < count) {
+        while (running < parallel && next < count) {
+            fflush(stdout);
+            fflush(stderr);
+            pid_t pid = fork();
+            if (pid == 0) { // messages of a single run would interleave, only results are shown
+                if (!options.verbose) {
+                    freopen("/dev/null", "w", stdout);
+                }
+                exit(runImage(names[next]));
+            }
+            if (pid < 0) {
+                perror("Cannot start worker");
+                break;
+            }
+            pids[next] = pid;
+            started[next++] = now();
+            running++;
+        }
+        if (running == 0) { // cannot fork at all, give up on the rest
+            failed += count - done;
+            break;
+        }
+
+        int status, i;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0) {
+            break;
+        }
+        for (i = 0; i < next && pids[i] != pid; i++);
+        int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        double seconds = now() - started[i];
+        busy += seconds;
+        peakKb = usage.ru_maxrss > peakKb ? usage.ru_maxrss : peakKb;
+        failed += !ok;
+        running--;
+        done++;
+        printf("%-40s %-6s %10.3f %10ld\n", names[i], ok ? "ok" : "FAILED", seconds, usage.ru_maxrss);
+    }
+
+    double wall = now() - batchStart;
+    printf("%d images, %d succeeded, %d failed, %d at a time, %.3f s wall, %.3f s summed, peak %ld KB\n",
+           count, count - failed, failed, parallel, wall, busy, peakKb);
+    free(pids);
+    free(started);
+    return failed != 0;
+}
+
+int main(int argc, char* argv[]) {
+    static struct option longOptions[] = {
+        {"manifest", required_argument, NULL, 'M'},
+        {"parallel", required_argument, NULL, 'P'},
+        {"mmap", no_argument, NULL, 'm'},
+        {"uring", no_argument, NULL, 'u'},
+        {"analyze", no_argument, NULL, 'a'},
+        {"in-place", no_argument, NULL, 'i'},
+        {"incremental", no_argument, NULL, 'I'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"extract", required_argument, NULL, 'x'},
+        {"sparse", no_argument, NULL, 's'},
+        {"compact-inodes", no_argument, NULL, 'c'},
+        {"layout", required_argument, NULL, 'L'},
+        {"stats", required_argument, NULL, 'S'},
+        {"patch", required_argument, NULL, 'D'},
+        {"apply", required_argument, NULL, 'A'},
+        {"stream", optional_argument, NULL, 'T'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"check", no_argument, NULL, 'C'},
+        {"repair", no_argument, NULL, 'R'},
+        {"no-check", no_argument, NULL, 'K'},
+        {"emit-map", required_argument, NULL, 'E'},
+        {"no-checkpoint", no_argument, NULL, 'X'},
+        {"verify", no_argument, NULL, 'V'},
+        {"no-verify", no_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    int parallel = 0;
+    char* manifestName = NULL;
+    defaultOptions(&options);
+    while ((opt = getopt_long(argc, argv, "muaiIj:scL:x:vP:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                options.engine = ENGINE_MMAP;
+                break;
+            case 'u':
+                options.engine = ENGINE_URING;
+                break;
+            case 'a':
+                analyzeMode++;
+                break;
+            case 'i':
+                inPlaceMode = 1;
+                break;
+            case 'I':
+                options.incremental = 1;
+                break;
+            case 'j':
+                options.threads = jobs = atoi(optarg);
+                if (options.threads < 1) {
+                    usage();
+                }
+                break;
+            case 's':
+                options.sparse = 1;
+                break;
+            case 'c':
+                options.compactInodes = 1;
+                break;
+            case 'x':
+                extractDirectory = optarg;
+                break;
+            case 'M':
+                manifestName = optarg;
+                break;
+            case 'P':
+                parallel = atoi(optarg);
+                if (parallel < 1) {
+                    usage();
+                }
+                break;
+            case 'S':
+                statsName = optarg;
+                break;
+            case 'D':
+                patchName = optarg;
+                break;
+            case 'A':
+                applyName = optarg;
+                break;
+            case 'T':
+                streamMode = 1;
+                if (optarg != NULL && (options.streamMemory = (size_t) atol(optarg) << 20) == 0) {
+                    usage();
+                }
+                break;
+            case 'v':
+                options.verbose = 1;
+                break;
+            case 'C':
+                checkMode = CHECK_ONLY;
+                break;
+            case 'R':
+                checkMode = CHECK_REPAIR;
+                break;
+            case 'K':
+                checkMode = CHECK_NONE;
+                break;
+            case 'E':
+                emitMapName = optarg;
+                break;
+            case 'X':
+                checkpointMode = 0;
+                break;
+            case 'V':
+                verifyMode = 1;
+                break;
+            case 'N':
+                verifyMode = 0;
+                break;
+            case 'L':
+                if (parseLayout(optarg) != 0) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    if (streamMode) { // nothing else works on a stream
+        if (optind != argc || manifestName != NULL || analyzeMode || extractDirectory != NULL || inPlaceMode ||
+            options.incremental || checkMode >= CHECK_ONLY || patchName != NULL || applyName != NULL) {
+            usage();
+        }
+        return runImage("-");
+    }
+    if (patchName != NULL && (inPlaceMode || applyName != NULL)) {
+        usage();
+    }
+    if (manifestName == NULL && optind == argc - 1) {
+        return runImage(argv[optind]);
+    }
+    // every image would go into the same directory, map or patch
+    if (extractDirectory != NULL || emitMapName != NULL || patchName != NULL || applyName != NULL) {
+        usage();
+    }
+    statsName = NULL; // runs of a batch would overwrite each other, the summary stands for them
+
+    // batch: images given on the command line, then those listed in manifest
+    int count = argc - optind;
+    char** names = malloc(sizeof(char*) * (count + 1));
+    memcpy(names, argv + optind, sizeof(char*) * count);
+    if (manifestName != NULL && (count = readManifest(manifestName, &names, count)) < 0) {
+        perror("Cannot read manifest");
+        exit(1);
+    }
+    if (count == 0) {
+        usage();
+    }
+    if (parallel <= 0) { // one image per CPU, each one already takes -j threads
+        parallel = (int) sysconf(_SC_NPROCESSORS_ONLN) / (jobs > 0 ? jobs : 1);
+        parallel = parallel > 0 ? parallel : 1;
+    }
+    return batch(names, count, parallel < count ? parallel : count);
+}
@@ -0,0 +1,84 @@
+#include <getopt.h>
+#include "afsgen.h"
+
+void usage() {
+    fprintf(stderr, "Usage: mkafs [options] image-file\n");
+    fprintf(stderr, "  -b SIZE    block size in bytes (512)\n");
+    fprintf(stderr, "  -n COUNT   number of inodes (256)\n");
+    fprintf(stderr, "  -f COUNT   number of live files (128)\n");
+    fprintf(stderr, "  -d DIST    file size distribution: small, mixed or large (mixed)\n");
+    fprintf(stderr, "  -F RATIO   fragmentation, share of shuffled data blocks from 0 to 1 (1)\n");
+    fprintf(stderr, "  -l LEVEL   deepest indirection used: 0 direct, 1 I1, 2 I2, 3 I3 (1)\n");
+    fprintf(stderr, "  -x COUNT   free data blocks (256)\n");
+    fprintf(stderr, "  -w COUNT   swap region blocks (64)\n");
+    fprintf(stderr, "  -g COUNT   unused blocks left as a hole ahead of inode region, for huge sparse images (0)\n");
+    fprintf(stderr, "  -s SEED    random seed (1)\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    afsParams params;
+    defaultParams(&params);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:f:d:F:l:x:w:g:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                params.blockSize = atoi(optarg);
+                break;
+            case 'n':
+                params.inodeCount = atoi(optarg);
+                break;
+            case 'f':
+                params.fileCount = atoi(optarg);
+                break;
+            case 'd':
+                if (strcmp(optarg, "small") == 0) {
+                    params.distribution = SIZE_SMALL;
+                } else if (strcmp(optarg, "mixed") == 0) {
+                    params.distribution = SIZE_MIXED;
+                } else if (strcmp(optarg, "large") == 0) {
+                    params.distribution = SIZE_LARGE;
+                } else {
+                    usage();
+                }
+                break;
+            case 'F':
+                params.fragmentation = atof(optarg);
+                break;
+            case 'l':
+                params.indirection = atoi(optarg);
+                break;
+            case 'x':
+                params.freeBlocks = atoi(optarg);
+                break;
+            case 'w':
+                params.swapBlocks = atoi(optarg);
+                break;
+            case 'g':
+                params.gapBlocks = atoi(optarg);
+                break;
+            case 's':
+                params.seed = (unsigned) atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1 || params.blockSize < DEFAULT_BLOCK_SIZE || params.blockSize % sizeof(int) != 0
+        || params.fileCount > params.inodeCount || params.indirection < 0 || params.indirection > 3
+        || params.fragmentation < 0 || params.fragmentation > 1 || params.gapBlocks < 0) {
+        usage();
+    }
+
+    FILE* outFile = fopen(argv[optind], "w");
+    if (outFile == NULL) {
+        perror("Cannot create image file.");
+        exit(1);
+    }
+    off_t size = generateImage(outFile, &params);
+    fclose(outFile);
+
+    printf("Image generated: %s (%lld bytes)\n", argv[optind], (long long) size);
+    return 0;
+}
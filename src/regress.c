@@ -0,0 +1,671 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "afsgen.h"
+#include "uring.h"
+
+/**** Regression cases: images no precheck would let through, run straight into defragmenter() ****/
+
+#define INODE_SIZE 100
+#define CASE_SECONDS 60 /* a case running longer is taken as hung, the alarm ends the whole run */
+
+/**
+ * Find the first live inode of a generated image
+ * @return Byte offset of the inode, -1 if the image has none
+ */
+off_t firstLiveInode(FILE *image, int inodeCount, superblock *super, inode *node) {
+    int i;
+    fseeko(image, DEFAULT_BLOCK_SIZE, SEEK_SET);
+    fread(super, sizeof(superblock), 1, image);
+    for (i = 0; i < inodeCount; i++) {
+        off_t offset = 1024 + (off_t) super->inode_offset * super->size + (off_t) i * INODE_SIZE;
+        fseeko(image, offset, SEEK_SET);
+        fread(node, sizeof(inode), 1, image);
+        if (node->nlink > 0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Generate an image of contiguous single-block files, then point the first live file out of data region
+ * @return 0 on success, -1 if the image has no live file
+ */
+int outOfRangeImage(FILE *image) {
+    afsParams params;
+    superblock super;
+    inode node;
+    defaultParams(&params);
+    params.distribution = SIZE_SMALL;
+    params.fragmentation = 0;
+    params.indirection = 0;
+    generateImage(image, &params);
+
+    off_t offset = firstLiveInode(image, params.inodeCount, &super, &node);
+    if (offset < 0) {
+        return -1;
+    }
+    node.dblocks[0] = super.swap_offset - super.data_offset + 1;
+    fseeko(image, offset, SEEK_SET);
+    fwrite(&node, sizeof(inode), 1, image);
+    fflush(image);
+    return 0;
+}
+
+/**
+ * Incremental mode surveys where a file lies before it picks what to move, a pointer out of data region
+ * must count as fragmented, not as a block ahead of the region
+ */
+int incrementalOutOfRange() {
+    FILE *image = tmpfile();
+    FILE *output = tmpfile();
+    if (image == NULL || output == NULL || outOfRangeImage(image) < 0) {
+        return 1;
+    }
+    defragOptions options;
+    defaultOptions(&options);
+    options.incremental = 1;
+    defragContext *ctx = createContext(&options);
+    int result = defragmenter(ctx, image, output, NULL);
+    destroyContext(ctx);
+    fclose(image);
+    fclose(output);
+    return result == ERROR_DATA_BLOCK_LOST ? 0 : 1;
+}
+
+/**
+ * A repair that cannot reach the image must leave the free space error standing, not report it fixed
+ */
+int repairReadOnly() {
+    char name[] = "/tmp/regress-XXXXXX";
+    afsParams params;
+    int noFree = -1, result = 0;
+    int fd = mkstemp(name);
+    FILE *image = fd < 0 ? NULL : fdopen(fd, "w+");
+    if (image == NULL) {
+        return 1;
+    }
+    defaultParams(&params);
+    generateImage(image, &params);
+    fseeko(image, DEFAULT_BLOCK_SIZE + offsetof(superblock, free_iblock), SEEK_SET);
+    fwrite(&noFree, sizeof(int), 1, image); // every free block leaks
+    fclose(image);
+
+    image = fopen(name, "r");
+    defragOptions options;
+    defaultOptions(&options);
+    defragContext *ctx = createContext(&options);
+    if (image != NULL) {
+        result = checker(ctx, image, 1);
+        fclose(image);
+    }
+    destroyContext(ctx);
+    remove(name);
+    return result & ERROR_CORRUPTED_FREE_DATA ? 0 : 1;
+}
+
+/**
+ * A read io_uring completes short, past the end of a truncated image, must count as failed,
+ * otherwise stale buffer content goes to output unnoticed
+ */
+int uringShortRead() {
+    char buffer[2 * DEFAULT_BLOCK_SIZE];
+    blockRing ring;
+    struct iovec buffers[1] = {{buffer, sizeof(buffer)}};
+    FILE *image = tmpfile();
+    if (image == NULL || fwrite(buffer, DEFAULT_BLOCK_SIZE, 1, image) != 1 || fflush(image) != 0) {
+        return 1;
+    }
+    if (ringOpen(&ring, 4, buffers, 1) != 0) { // nothing to test without io_uring
+        fclose(image);
+        return 0;
+    }
+    ringQueue(&ring, 0, fileno(image), 0, buffer, sizeof(buffer), 0);
+    int failed = ringWait(&ring);
+    ringClose(&ring);
+    fclose(image);
+    return failed == 1 ? 0 : 1;
+}
+
+/**
+ * A free list that strays into a file and loops there must be reported, the walk must not go round forever
+ */
+int freeListCycle() {
+    afsParams params;
+    superblock super;
+    inode node;
+    FILE *image = tmpfile();
+    if (image == NULL) {
+        return 1;
+    }
+    defaultParams(&params);
+    generateImage(image, &params);
+    if (firstLiveInode(image, params.inodeCount, &super, &node) < 0) {
+        fclose(image);
+        return 1;
+    }
+    int blk = node.dblocks[0]; // first word of a used block points back to it, and the list starts there
+    fseeko(image, 1024 + ((off_t) super.data_offset + blk) * super.size, SEEK_SET);
+    fwrite(&blk, sizeof(int), 1, image);
+    fseeko(image, DEFAULT_BLOCK_SIZE + offsetof(superblock, free_iblock), SEEK_SET);
+    fwrite(&blk, sizeof(int), 1, image);
+    fflush(image);
+
+    defragOptions options;
+    defaultOptions(&options);
+    defragContext *ctx = createContext(&options);
+    int result = checker(ctx, image, 0);
+    destroyContext(ctx);
+    fclose(image);
+    return result & ERROR_CORRUPTED_FREE_DATA ? 0 : 1;
+}
+
+/**
+ * Regions of a super block out of order must be refused before anything is sized from them
+ */
+int superBlockOutOfOrder() {
+    afsParams params;
+    superblock super;
+    FILE *image = tmpfile();
+    if (image == NULL) {
+        return 1;
+    }
+    defaultParams(&params);
+    generateImage(image, &params);
+    fseeko(image, DEFAULT_BLOCK_SIZE, SEEK_SET);
+    fread(&super, sizeof(superblock), 1, image);
+    super.swap_offset = super.data_offset - 1;
+    fseeko(image, DEFAULT_BLOCK_SIZE, SEEK_SET);
+    fwrite(&super, sizeof(superblock), 1, image);
+    fflush(image);
+
+    defragOptions options;
+    defaultOptions(&options);
+    defragContext *ctx = createContext(&options);
+    int result = checker(ctx, image, 0);
+    destroyContext(ctx);
+    fclose(image);
+    return result == ERROR_DATA_BLOCK_LOST ? 0 : 1;
+}
+
+/**
+ * An image cut short of the regions its super block describes must be refused before the mmap engine
+ * reads past the end of its map, where stdio would only get a short read
+ */
+int mmapTruncated() {
+    afsParams params;
+    FILE *image = tmpfile();
+    FILE *output = tmpfile();
+    if (image == NULL || output == NULL) {
+        return 1;
+    }
+    defaultParams(&params);
+    off_t size = generateImage(image, &params);
+    fflush(image);
+    if (ftruncate(fileno(image), size / 2) != 0) {
+        return 1;
+    }
+
+    defragOptions options;
+    defaultOptions(&options);
+    options.engine = ENGINE_MMAP;
+    defragContext *ctx = createContext(&options);
+    int result = defragmenter(ctx, image, output, NULL);
+    int error = contextError(ctx);
+    destroyContext(ctx);
+    fclose(image);
+    fclose(output);
+    return result != 0 && error == ERROR_DATA_BLOCK_LOST ? 0 : 1;
+}
+
+/**
+ * Writes that do not land, here on a full device, must fail the run rather than report success
+ */
+int fullDevice(int threads) {
+    afsParams params;
+    FILE *image = tmpfile();
+    FILE *output = fopen("/dev/full", "w");
+    if (image == NULL || output == NULL) {
+        return 1;
+    }
+    defaultParams(&params);
+    generateImage(image, &params);
+    fflush(image);
+
+    defragOptions options;
+    defaultOptions(&options);
+    options.threads = threads;
+    defragContext *ctx = createContext(&options);
+    int result = defragmenter(ctx, image, output, NULL);
+    int error = contextError(ctx);
+    destroyContext(ctx);
+    fclose(image);
+    fclose(output);
+    return result != 0 && (error & ERROR_DATA_BLOCK_LOST) ? 0 : 1;
+}
+
+int fullDeviceStdio() {
+    return fullDevice(1);
+}
+
+int fullDevicePositional() {
+    return fullDevice(4);
+}
+
+/**** Engines and modes: each one must produce what a plain stdio run produces ****/
+
+/**
+ * Tell if two files hold the same bytes, both are read from their start
+ * @return 0 if they do, 1 otherwise
+ */
+int sameContent(FILE *a, FILE *b) {
+    char x[4096], y[4096];
+    size_t n, m;
+    fflush(a);
+    fflush(b);
+    rewind(a);
+    rewind(b);
+    do {
+        n = fread(x, 1, sizeof(x), a);
+        m = fread(y, 1, sizeof(y), b);
+        if (n != m || memcmp(x, y, n) != 0) {
+            return 1;
+        }
+    } while (n > 0);
+    return 0;
+}
+
+/**
+ * Copy a whole file into another one, from their start
+ */
+void copyContent(FILE *from, FILE *to) {
+    char buffer[4096];
+    size_t n;
+    fflush(from);
+    rewind(from);
+    rewind(to);
+    while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        fwrite(buffer, 1, n, to);
+    }
+    fflush(to);
+}
+
+/**
+ * Generate the image every case of this part starts from, fragmented, with indirect blocks
+ * @return The image, NULL if it cannot be created
+ */
+FILE *fragmentedImage() {
+    afsParams params;
+    FILE *image = tmpfile();
+    if (image == NULL) {
+        return NULL;
+    }
+    defaultParams(&params);
+    generateImage(image, &params);
+    fflush(image);
+    return image;
+}
+
+/**
+ * Defragment image with default options, the stdio engine, which every other engine and mode is held to
+ * @return Output image, NULL if the run fails
+ */
+FILE *stdioRun(FILE *image) {
+    defragOptions options;
+    FILE *output = tmpfile();
+    if (output == NULL) {
+        return NULL;
+    }
+    defaultOptions(&options);
+    defragContext *ctx = createContext(&options);
+    int result = defragmenter(ctx, image, output, NULL);
+    destroyContext(ctx);
+    if (result != 0) {
+        fclose(output);
+        return NULL;
+    }
+    return output;
+}
+
+/**
+ * Run defragmenter with given engine over the image, output must match the one of stdio engine
+ */
+int engineMatchesStdio(int engine) {
+    FILE *image = fragmentedImage();
+    FILE *expected = image == NULL ? NULL : stdioRun(image);
+    FILE *output = tmpfile();
+    int result = 1;
+    if (expected != NULL && output != NULL) {
+        defragOptions options;
+        defaultOptions(&options);
+        options.engine = engine;
+        defragContext *ctx = createContext(&options);
+        result = defragmenter(ctx, image, output, NULL) != 0 || sameContent(expected, output) != 0;
+        destroyContext(ctx);
+    }
+    if (output != NULL) fclose(output);
+    if (expected != NULL) fclose(expected);
+    if (image != NULL) fclose(image);
+    return result;
+}
+
+int uringMatchesStdio() {
+    return engineMatchesStdio(ENGINE_URING);
+}
+
+int mmapMatchesStdio() {
+    return engineMatchesStdio(ENGINE_MMAP);
+}
+
+/**
+ * A stream run reads input and writes output once, front to back, its output must match the one of stdio engine
+ */
+int streamMatchesStdio() {
+    FILE *image = fragmentedImage();
+    FILE *expected = image == NULL ? NULL : stdioRun(image);
+    FILE *output = tmpfile();
+    int result = 1;
+    if (expected != NULL && output != NULL) {
+        defragOptions options;
+        defaultOptions(&options);
+        defragContext *ctx = createContext(&options);
+        rewind(image);
+        result = streamDefragmenter(ctx, image, output) != 0 || sameContent(expected, output) != 0;
+        destroyContext(ctx);
+    }
+    if (output != NULL) fclose(output);
+    if (expected != NULL) fclose(expected);
+    if (image != NULL) fclose(image);
+    return result;
+}
+
+/**
+ * A patch applied to a copy of the image must turn it into the output of stdio engine
+ */
+int patchMatchesStdio() {
+    FILE *image = fragmentedImage();
+    FILE *expected = image == NULL ? NULL : stdioRun(image);
+    FILE *patch = tmpfile();
+    FILE *copy = tmpfile();
+    int result = 1;
+    if (expected != NULL && patch != NULL && copy != NULL) {
+        defragOptions options;
+        defaultOptions(&options);
+        defragContext *ctx = createContext(&options);
+        copyContent(image, copy);
+        if (patchDefragmenter(ctx, image, patch) == 0 && fflush(patch) == 0) {
+            rewind(patch);
+            result = applyPatch(ctx, patch, copy) != 0 || sameContent(expected, copy) != 0;
+        }
+        destroyContext(ctx);
+    }
+    if (copy != NULL) fclose(copy);
+    if (patch != NULL) fclose(patch);
+    if (expected != NULL) fclose(expected);
+    if (image != NULL) fclose(image);
+    return result;
+}
+
+/**
+ * Interrupt a run with a relocation map halfway through its copy pass: blocks swept before the last checkpoint
+ * are in output, the others hold garbage
+ * The resumed run must take its plan from the map, copy only what is left, and still match stdio engine
+ */
+int checkpointResume() {
+    char name[] = "/tmp/regress-XXXXXX";
+    FILE *image = fragmentedImage();
+    FILE *expected = image == NULL ? NULL : stdioRun(image);
+    FILE *output = tmpfile();
+    int fd = mkstemp(name);
+    FILE *map = fd < 0 ? NULL : fdopen(fd, "r+");
+    int result = 1;
+    if (expected != NULL && output != NULL && map != NULL) {
+        defragOptions options;
+        defaultOptions(&options);
+        defragContext *ctx = createContext(&options);
+        size_t fullRun = 0;
+        if (defragmenter(ctx, image, output, name) == 0) {
+            fullRun = contextStats(ctx)->bytesWritten;
+        }
+        destroyContext(ctx);
+
+        relocationMap header;
+        int *relocation = NULL;
+        rewind(map);
+        if (fullRun > 0 && fread(&header, sizeof(relocationMap), 1, map) == 1) {
+            relocation = malloc(sizeof(int) * header.dataRegion);
+            if (fread(relocation, sizeof(int), header.dataRegion, map) != (size_t) header.dataRegion) {
+                free(relocation);
+                relocation = NULL;
+            }
+        }
+        if (relocation != NULL) {
+            int src;
+            char *garbage = malloc(header.super.size);
+            memset(garbage, 0xA5, header.super.size);
+            header.copied = header.dataRegion / 2;
+            for (src = header.copied; src < header.dataRegion; src++) {
+                if (relocation[src] >= 0) {
+                    fseeko(output, 1024 + ((off_t) header.super.data_offset + relocation[src]) * header.super.size,
+                           SEEK_SET);
+                    fwrite(garbage, header.super.size, 1, output);
+                }
+            }
+            fflush(output);
+            rewind(map);
+            fwrite(&header, sizeof(relocationMap), 1, map);
+            fflush(map);
+            free(garbage);
+            free(relocation);
+
+            ctx = createContext(&options);
+            result = defragmenter(ctx, image, output, name) != 0 || contextStats(ctx)->bytesWritten >= fullRun ||
+                     sameContent(expected, output) != 0;
+            destroyContext(ctx);
+        }
+    }
+    if (map != NULL) fclose(map);
+    if (fd >= 0) remove(name);
+    if (output != NULL) fclose(output);
+    if (expected != NULL) fclose(expected);
+    if (image != NULL) fclose(image);
+    return result;
+}
+
+/**
+ * Compacting inodes only renumbers them: files must keep their content in the order of their old numbers,
+ * and data region must match the one of stdio engine
+ */
+int compactMatchesStdio() {
+    FILE *image = fragmentedImage();
+    FILE *expected = image == NULL ? NULL : stdioRun(image);
+    FILE *output = tmpfile();
+    int result = 1;
+    if (expected != NULL && output != NULL) {
+        superblock super;
+        size_t count;
+        defragOptions options;
+        defaultOptions(&options);
+        options.compactInodes = 1;
+        defragContext *ctx = createContext(&options);
+        fileDigest *before = digestFiles(ctx, image, &count);
+        if (defragmenter(ctx, image, output, NULL) == 0 && checker(ctx, output, 0) == ERROR_ALL_GREEN &&
+            verifier(ctx, output, before, count) == 0) {
+            fseeko(expected, DEFAULT_BLOCK_SIZE, SEEK_SET);
+            fread(&super, sizeof(superblock), 1, expected);
+            char *x = malloc(super.size), *y = malloc(super.size);
+            int blk;
+            result = 0;
+            for (blk = super.data_offset; blk < super.swap_offset && result == 0; blk++) {
+                fseeko(expected, 1024 + (off_t) blk * super.size, SEEK_SET);
+                fseeko(output, 1024 + (off_t) blk * super.size, SEEK_SET);
+                result = fread(x, super.size, 1, expected) != 1 || fread(y, super.size, 1, output) != 1 ||
+                         memcmp(x, y, super.size) != 0;
+            }
+            free(x);
+            free(y);
+        }
+        free(before);
+        destroyContext(ctx);
+    }
+    if (output != NULL) fclose(output);
+    if (expected != NULL) fclose(expected);
+    if (image != NULL) fclose(image);
+    return result;
+}
+
+/**
+ * Tell if two directories of extracted files hold the same names with the same bytes
+ * @return 0 if they do, 1 otherwise
+ */
+int sameTree(const char *a, const char *b) {
+    char x[4096], y[4096];
+    struct dirent *entry;
+    int files = 0, result = 0;
+    DIR *directory = opendir(a);
+    if (directory == NULL) {
+        return 1;
+    }
+    while (result == 0 && (entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(x, sizeof(x), "%s/%s", a, entry->d_name);
+        snprintf(y, sizeof(y), "%s/%s", b, entry->d_name);
+        FILE *p = fopen(x, "r"), *q = fopen(y, "r");
+        result = p == NULL || q == NULL || sameContent(p, q) != 0;
+        if (p != NULL) fclose(p);
+        if (q != NULL) fclose(q);
+        files++;
+    }
+    closedir(directory);
+
+    directory = opendir(b); // and nothing more in b
+    while (result == 0 && directory != NULL && (entry = readdir(directory)) != NULL) {
+        files -= entry->d_name[0] != '.';
+    }
+    if (directory != NULL) closedir(directory);
+    return result != 0 || files != 0;
+}
+
+/**
+ * Remove a directory of extracted files
+ */
+void removeTree(const char *name) {
+    char path[4096];
+    struct dirent *entry;
+    DIR *directory = opendir(name);
+    while (directory != NULL && (entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", name, entry->d_name);
+            remove(path);
+        }
+    }
+    if (directory != NULL) closedir(directory);
+    rmdir(name);
+}
+
+/**
+ * Defragment a copy of the image in place, optionally recovering from a journal left by an interrupted run
+ * The image must pass the checker and extract to the very files of the original
+ * @param replay Non-zero to start from a journal saved right before the first move, as a crash would leave it:
+ *               a first run writes its journal through a symbolic link, the journal outlives the run,
+ *               it is rewound to its first move, then recovered over a fresh copy of the image
+ */
+int inPlaceMatchesOriginal(int replay) {
+    char journal[] = "/tmp/regress-XXXXXX", kept[4096], original[] = "/tmp/regress-XXXXXX",
+         moved[] = "/tmp/regress-XXXXXX";
+    FILE *image = fragmentedImage();
+    FILE *copy = tmpfile();
+    int result = 1;
+    int fd = mkstemp(journal);
+    if (fd >= 0) {
+        close(fd);
+        remove(journal); // a journal that exists is recovered
+    }
+    snprintf(kept, sizeof(kept), "%s-kept", journal);
+    if (image == NULL || copy == NULL || fd < 0 || mkdtemp(original) == NULL || mkdtemp(moved) == NULL) {
+        if (image != NULL) fclose(image);
+        if (copy != NULL) fclose(copy);
+        return 1;
+    }
+    defragOptions options;
+    defaultOptions(&options);
+    defragContext *ctx = createContext(&options);
+    copyContent(image, copy);
+    if (extractor(ctx, image, original, 1) == 0) {
+        result = 0;
+        if (replay) {
+            // the run creates its journal through the link, and removes only the link
+            result = symlink(kept, journal) != 0 || defragmentInPlace(ctx, copy, journal) != 0;
+            // done and pending moves follow magic and four ints, see journalHeader in defrag.c
+            long rewound[2] = {0, 0};
+            FILE *link = result == 0 ? fopen(kept, "r+") : NULL;
+            result |= link == NULL || fseeko(link, 8 + 4 * sizeof(int) + sizeof(long), SEEK_SET) != 0 ||
+                      fwrite(rewound, sizeof(rewound), 1, link) != 1;
+            if (link != NULL) fclose(link);
+            result |= rename(kept, journal) != 0;
+            copyContent(image, copy);
+        }
+        result = result != 0 || defragmentInPlace(ctx, copy, journal) != 0 || access(journal, F_OK) == 0 ||
+                 checker(ctx, copy, 0) != ERROR_ALL_GREEN || extractor(ctx, copy, moved, 1) != 0 ||
+                 sameTree(original, moved) != 0;
+    }
+    destroyContext(ctx);
+    remove(journal);
+    remove(kept);
+    removeTree(original);
+    removeTree(moved);
+    fclose(copy);
+    fclose(image);
+    return result;
+}
+
+int inPlaceRun() {
+    return inPlaceMatchesOriginal(0);
+}
+
+int inPlaceJournalReplay() {
+    return inPlaceMatchesOriginal(1);
+}
+
+struct {
+    const char *name;
+    int (*run)();
+} regressions[] = {
+    {"incremental with a dblock out of range", incrementalOutOfRange},
+    {"free list repair of a read-only image", repairReadOnly},
+    {"io_uring read past end of image", uringShortRead},
+    {"free list looping inside a file", freeListCycle},
+    {"super block with swap region ahead of data region", superBlockOutOfOrder},
+    {"mmap engine over a truncated image", mmapTruncated},
+    {"stdio writes to a full device", fullDeviceStdio},
+    {"positional writes to a full device", fullDevicePositional},
+    {"io_uring engine against stdio", uringMatchesStdio},
+    {"mmap engine against stdio", mmapMatchesStdio},
+    {"stream run against stdio", streamMatchesStdio},
+    {"patch applied to image against stdio", patchMatchesStdio},
+    {"run resumed from a checkpoint against stdio", checkpointResume},
+    {"compacted inodes against stdio", compactMatchesStdio},
+    {"in-place run against original files", inPlaceRun},
+    {"in-place journal replay against original files", inPlaceJournalReplay},
+};
+
+int main(int argc, char* argv[]) {
+    int i, failed = 0;
+    int console = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    for (i = 0; i < sizeof(regressions) / sizeof(regressions[0]); i++) {
+        fflush(stdout);
+        dup2(devNull, STDOUT_FILENO); // keep reports of checker and super block dumps out of the results
+        alarm(CASE_SECONDS);
+        int result = regressions[i].run();
+        fflush(stdout);
+        dup2(console, STDOUT_FILENO);
+        printf("%-50s %s\n", regressions[i].name, result == 0 ? "ok" : "FAILED");
+        failed += result != 0;
+    }
+    return failed > 0;
+}
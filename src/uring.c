@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+/**
+ * This function set up a ring of given depth, map its queues, and register buffers as fixed buffers
+ * Every transfer queued later must lie inside one of these buffers
+ * @param entries Submission queue depth, i.e. maximum number of requests in flight
+ * @param buffers Buffers to be registered, they are pinned by kernel until the ring is closed
+ * @return 0 on success, -1 if io_uring is not available
+ */
+int ringOpen(blockRing *ring, unsigned entries, struct iovec *buffers, unsigned count) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(blockRing));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ringClose(ring);
+        return -1;
+    }
+
+    ring->sqHead = (unsigned *) ((char *) ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned *) ((char *) ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned *) ((char *) ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) ((char *) ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned *) ((char *) ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *) ((char *) ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned *) ((char *) ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqRing + params.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, count) < 0) {
+        ringClose(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Collect every completion available, without waiting
+ * A request that moved fewer bytes than asked, e.g. a read past the end of a truncated image, failed as well
+ */
+static void ringReap(blockRing *ring) {
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+        if (cqe->res < 0 || (__u64) cqe->res != cqe->user_data) {
+            ring->failed++;
+        }
+        ring->inFlight--;
+        head++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submit all queued requests, and wait until at least waitCount requests have completed
+ */
+static void ringEnter(blockRing *ring, unsigned waitCount) {
+    unsigned submit = ring->queued;
+    ring->inFlight += ring->queued;
+    ring->queued = 0;
+    while (1) {
+        long done = syscall(__NR_io_uring_enter, ring->fd, submit, waitCount,
+                            waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (done < 0 && errno != EINTR) { // nothing more can be submitted, count them as failed
+            ring->failed += submit;
+            ring->inFlight -= submit;
+            break;
+        }
+        if (done >= 0) {
+            submit -= (unsigned) done < submit ? (unsigned) done : submit;
+            if (submit == 0) {
+                break;
+            }
+        }
+    }
+    ringReap(ring);
+}
+
+/**
+ * This function queue a fixed-buffer read or write, the submission is deferred until the queue is full
+ * or ringWait is called, so the buffer must stay untouched until then
+ * @param write 0 for read, otherwise write
+ * @param bufferIndex Index of the registered buffer that address lies in
+ */
+void ringQueue(blockRing *ring, int write, int fd, unsigned bufferIndex, void *address, size_t length, off_t offset) {
+    if (ring->queued + ring->inFlight >= ring->entries) { // keep completion queue from overflowing
+        ringEnter(ring, 1);
+    }
+
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) address;
+    sqe->len = (unsigned) length;
+    sqe->off = offset;
+    sqe->buf_index = (unsigned short) bufferIndex;
+    sqe->user_data = length; // handed back in the completion, to tell a short transfer
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/**
+ * Submit everything queued and wait for all requests in flight to complete
+ * @return Number of failed requests since the ring was opened
+ */
+int ringWait(blockRing *ring) {
+    while (ring->queued + ring->inFlight > 0) {
+        ringEnter(ring, ring->queued + ring->inFlight);
+    }
+    return ring->failed;
+}
+
+void ringClose(blockRing *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    ring->fd = -1;
+}
@@ -0,0 +1,46 @@
+#ifndef P5_URING_H
+#define P5_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring wrapper for batched block transfers, talks to the kernel through raw system calls
+typedef struct {
+    int fd;
+    unsigned entries;
+
+    // submission queue
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    unsigned queued;   /* requests queued but not submitted yet */
+    unsigned inFlight; /* requests submitted but not completed yet */
+    int failed;        /* number of requests completed with an error or short of their length */
+} blockRing;
+
+int ringOpen(blockRing *ring, unsigned entries, struct iovec *buffers, unsigned count);
+
+void ringQueue(blockRing *ring, int write, int fd, unsigned bufferIndex, void *address, size_t length, off_t offset);
+
+int ringWait(blockRing *ring);
+
+void ringClose(blockRing *ring);
+
+#endif //P5_URING_H